@@ -0,0 +1,102 @@
+//! Prints how many heap allocations, and how many bytes, each public allocator operation makes, counted by a wrapping global allocator; every ciphertext clone or fresh operation result shows up here as at least one allocation.
+//! Counts include rayon's own bookkeeping, so compare runs on the same thread count; like `pbs_counts`, set `CRYPTMALLOC_ALLOC_BASELINE` to a file of earlier `name allocations bytes` lines to fail on any operation whose allocation count grew.
+//! Run with `cargo bench --bench allocations`.
+
+use cryptmalloc::{EncryptedPtr, SIZE_CLASSES};
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    collections::HashMap,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+mod support;
+
+struct Counting;
+
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+static BYTES: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        BYTES.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        BYTES.fetch_add(new_size as u64, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: Counting = Counting;
+
+/// allocations and bytes made while `op` runs, not counting dropping its result.
+fn count<R>(op: impl FnOnce() -> R) -> (u64, u64) {
+    let (allocations, bytes) = (
+        ALLOCATIONS.load(Ordering::Relaxed),
+        BYTES.load(Ordering::Relaxed),
+    );
+    let result = op();
+    let counted = (
+        ALLOCATIONS.load(Ordering::Relaxed) - allocations,
+        BYTES.load(Ordering::Relaxed) - bytes,
+    );
+    drop(result);
+    counted
+}
+
+fn main() {
+    let mut allocator = support::warmed_allocator();
+    let mut counts: Vec<(String, (u64, u64))> = Vec::new();
+
+    let sizes = SIZE_CLASSES
+        .map(|(block_size, _)| block_size as u64)
+        .into_iter()
+        .chain([1024]);
+    for size in sizes {
+        let request = allocator.keys().enc_u64(size);
+        counts.push((
+            format!("allocate/size_{size}"),
+            count(|| allocator.allocate(request)),
+        ));
+    }
+
+    let hit = allocator.allocate(allocator.keys().enc_u64(16)).value;
+    let miss = EncryptedPtr::new(allocator.keys().enc_u64(u64::MAX));
+    counts.push(("free/hit".into(), count(|| allocator.free(&hit))));
+    counts.push(("free/miss".into(), count(|| allocator.free(&miss))));
+
+    let batch: Vec<_> = (0..8)
+        .map(|request| allocator.keys().enc_u64(16 << (request % 5)))
+        .collect();
+    counts.push((
+        "allocate_many/8".into(),
+        count(|| allocator.allocate_many(&batch)),
+    ));
+    let pointers: Vec<_> = allocator
+        .allocate_many(&batch)
+        .into_iter()
+        .map(|option| option.value)
+        .collect();
+    for ptr in pointers {
+        allocator.free_deferred(ptr);
+    }
+    counts.push(("flush_frees/8".into(), count(|| allocator.flush_frees())));
+
+    for (name, (allocations, bytes)) in &counts {
+        println!("{name} {allocations} {bytes}");
+    }
+
+    let current: HashMap<&str, u64> = counts
+        .iter()
+        .map(|(name, (allocations, _))| (name.as_str(), *allocations))
+        .collect();
+    support::gate_on_baseline("CRYPTMALLOC_ALLOC_BASELINE", "allocations", &current);
+}
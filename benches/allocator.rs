@@ -0,0 +1,158 @@
+//! Criterion timings for every public allocator operation: construction, `allocate` per slab tier and for the arena, `free` hit and miss, the arena on its own, `EncryptedOption::combine_with`, and one EVM step.
+//! The `profile` group repeats a smallest-tier allocate and free under every `ParameterProfile`; run `cargo bench --bench allocator -- profile` on the deployment hardware to pick one.
+//! Compare against a saved run with `cargo bench --bench allocator -- --save-baseline main` and later `-- --baseline main`; per-call PBS counts come from the `pbs_counts` bench.
+
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use cryptmalloc::{
+    Arena, CryptMalloc, EncryptedOption, EncryptedPtr, Opcode, ParameterProfile, EVM, SIZE_CLASSES,
+};
+use std::time::{Duration, Instant};
+
+const ARENA_SIZE: u64 = 1 << 20;
+const ARENA_REQUEST: u64 = 1024;
+
+fn bench_new(c: &mut Criterion) {
+    let mut group = c.benchmark_group("new");
+    group.sample_size(10);
+    group.bench_function("crypt_malloc", |b| {
+        b.iter(|| CryptMalloc::new(black_box(ARENA_SIZE)))
+    });
+    group.finish();
+}
+
+fn bench_allocate(c: &mut Criterion) {
+    let mut allocator = CryptMalloc::new(ARENA_SIZE);
+    let sizes = SIZE_CLASSES
+        .map(|(block_size, _)| block_size as u64)
+        .into_iter()
+        .chain([ARENA_REQUEST]);
+
+    let mut group = c.benchmark_group("allocate");
+    group.sample_size(10);
+    for size in sizes {
+        let request = allocator.keys().enc_u64(size);
+        group.bench_function(format!("size_{size}"), |b| {
+            b.iter(|| allocator.allocate(request.clone()))
+        });
+    }
+    group.finish();
+}
+
+fn bench_free(c: &mut Criterion) {
+    let mut allocator = CryptMalloc::new(ARENA_SIZE);
+    let miss = EncryptedPtr::new(allocator.keys().enc_u64(u64::MAX));
+    let size = allocator.keys().enc_u64(16);
+
+    let mut group = c.benchmark_group("free");
+    group.sample_size(10);
+    group.bench_function("hit", |b| {
+        b.iter_custom(|iters| {
+            let mut elapsed = Duration::ZERO;
+            for _ in 0..iters {
+                let ptr = allocator.allocate(size.clone()).value;
+                let start = Instant::now();
+                allocator.free(&ptr);
+                elapsed += start.elapsed();
+            }
+            elapsed
+        })
+    });
+    group.bench_function("miss", |b| b.iter(|| allocator.free(&miss)));
+    group.finish();
+}
+
+fn bench_profiles(c: &mut Criterion) {
+    let mut group = c.benchmark_group("profile");
+    group.sample_size(10);
+    for profile in ParameterProfile::ALL {
+        let mut allocator = CryptMalloc::with_profile(profile, ARENA_SIZE);
+        let size = allocator.keys().enc_u64(16);
+        group.bench_function(format!("{profile:?}/allocate"), |b| {
+            b.iter(|| allocator.allocate(size.clone()))
+        });
+        group.bench_function(format!("{profile:?}/free"), |b| {
+            b.iter_custom(|iters| {
+                let mut elapsed = Duration::ZERO;
+                for _ in 0..iters {
+                    let ptr = allocator.allocate(size.clone()).value;
+                    let start = Instant::now();
+                    allocator.free(&ptr);
+                    elapsed += start.elapsed();
+                }
+                elapsed
+            })
+        });
+    }
+    group.finish();
+}
+
+fn bench_arena(c: &mut Criterion) {
+    let allocator = CryptMalloc::new(ARENA_SIZE);
+    let keys = allocator.keys();
+    let _guard = keys.context().enter();
+    let mut arena = Arena::new(
+        0,
+        u64::MAX / 2,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_zero_u64(),
+    );
+    let size = keys.enc_u64(ARENA_REQUEST);
+
+    let mut group = c.benchmark_group("arena");
+    group.bench_function("allocate", |b| b.iter(|| arena.allocate(size.clone())));
+    group.bench_function("reset", |b| b.iter(|| arena.reset()));
+    group.finish();
+}
+
+fn bench_combine(c: &mut Criterion) {
+    let allocator = CryptMalloc::new(ARENA_SIZE);
+    let keys = allocator.keys();
+    let _guard = keys.context().enter();
+    let left = EncryptedOption::none(EncryptedPtr::new(keys.enc_zero_u64()), keys.enc_false());
+    let right = EncryptedOption::some(EncryptedPtr::new(keys.enc_u64(64)), keys.enc_true());
+
+    c.bench_function("encrypted_option/combine_with", |b| {
+        b.iter(|| left.combine_with(black_box(&right)))
+    });
+}
+
+fn bench_evm_step(c: &mut Criterion) {
+    let allocator = CryptMalloc::new(ARENA_SIZE);
+    let keys = allocator.keys();
+    let _guard = keys.context().enter();
+    // a step costs the same whatever it executes; the loop keeps the stack moving and never halts, so every sample times a live step.
+    let program = vec![
+        Opcode::Push1 as u8,
+        7,
+        Opcode::Pop as u8,
+        Opcode::Push1 as u8,
+        0,
+        Opcode::Jump as u8,
+    ];
+    let mut evm = EVM::new(
+        program,
+        0,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_zero_u32(),
+        keys.enc_zero_u64(),
+    );
+
+    let mut group = c.benchmark_group("evm");
+    group.sample_size(10);
+    group.bench_function("step", |b| b.iter(|| evm.step()));
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_new,
+    bench_allocate,
+    bench_free,
+    bench_profiles,
+    bench_arena,
+    bench_combine,
+    bench_evm_step
+);
+criterion_main!(benches);
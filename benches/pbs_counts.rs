@@ -0,0 +1,167 @@
+//! Prints the programmable-bootstrap count of every public allocator operation, including `reallocate` in place and moving, `calloc` and `allocate_many` at several batch sizes, plus one `SlabClass::free` per default tier under each `FreeStrategy` and one allocate on the widest tier under each `SelectionMode`.
+//! Counts are data-independent by construction, so the harness panics when a hit and a miss (or two routed sizes) cost different amounts, or when a larger batch stops lowering the per-request cost; PBS is the only counter tfhe exposes and it dominates the cost of every comparison and mux.
+//! Run with `cargo bench --bench pbs_counts --features pbs-stats`; set `CRYPTMALLOC_PBS_BASELINE` to a file of earlier `name count` lines to fail on any operation whose count grew.
+
+use cryptmalloc::{
+    AddressCache, Arena, EncryptedOption, EncryptedPtr, FreeStrategy, Opcode, SelectionMode, EVM,
+    SIZE_CLASSES,
+};
+use std::collections::HashMap;
+
+mod support;
+
+fn count<R>(op: impl FnOnce() -> R) -> u64 {
+    tfhe::reset_pbs_count();
+    let result = op();
+    let pbs = tfhe::get_pbs_count();
+    drop(result);
+    pbs
+}
+
+fn main() {
+    let mut allocator = support::warmed_allocator();
+    let mut counts: Vec<(String, u64)> = Vec::new();
+
+    let sizes = SIZE_CLASSES
+        .map(|(block_size, _)| block_size as u64)
+        .into_iter()
+        .chain([1024]);
+    for size in sizes {
+        let request = allocator.keys().enc_u64(size);
+        counts.push((
+            format!("allocate/size_{size}"),
+            count(|| allocator.allocate(request)),
+        ));
+    }
+
+    let hit = allocator.allocate(allocator.keys().enc_u64(16)).value;
+    let miss = EncryptedPtr::new(allocator.keys().enc_u64(u64::MAX));
+    counts.push(("free/hit".into(), count(|| allocator.free(&hit))));
+    counts.push(("free/miss".into(), count(|| allocator.free(&miss))));
+
+    let kept = allocator.allocate(allocator.keys().enc_u64(16)).value;
+    let (stay, grow) = (allocator.keys().enc_u64(8), allocator.keys().enc_u64(24));
+    counts.push((
+        "reallocate/stay".into(),
+        count(|| allocator.reallocate(&kept, stay)),
+    ));
+    counts.push((
+        "reallocate/move".into(),
+        count(|| allocator.reallocate(&kept, grow)),
+    ));
+    let elements = allocator.keys().enc_u64(3);
+    counts.push(("calloc".into(), count(|| allocator.calloc(elements, 8))));
+
+    let batches = [1usize, 2, 4, 8, 16];
+    for batch in batches {
+        let sizes: Vec<_> = (0..batch)
+            .map(|request| allocator.keys().enc_u64(16 << (request % 5)))
+            .collect();
+        counts.push((
+            format!("allocate_many/{batch}"),
+            count(|| allocator.allocate_many(&sizes)),
+        ));
+    }
+
+    let keys = allocator.keys();
+    let _guard = keys.context().enter();
+    let mut arena = Arena::new(
+        0,
+        u64::MAX / 2,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_zero_u64(),
+    );
+    let arena_size = keys.enc_u64(1024);
+    counts.push((
+        "arena/allocate".into(),
+        count(|| arena.allocate(arena_size)),
+    ));
+    counts.push(("arena/reset".into(), count(|| arena.reset())));
+
+    let left = EncryptedOption::none(EncryptedPtr::new(keys.enc_zero_u64()), keys.enc_false());
+    let right = EncryptedOption::some(EncryptedPtr::new(keys.enc_u64(64)), keys.enc_true());
+    counts.push((
+        "encrypted_option/combine_with".into(),
+        count(|| left.combine_with(&right)),
+    ));
+
+    let mut program = [Opcode::Push1 as u8, 1].repeat(15);
+    program.extend([Opcode::Add as u8, Opcode::Stop as u8]);
+    let mut stepper = EVM::new(
+        program,
+        1024,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_zero_u32(),
+        keys.enc_zero_u64(),
+    );
+    counts.push(("evm/step_32".into(), count(|| stepper.step())));
+
+    let ptr = EncryptedPtr::new(keys.enc_u64(0));
+    for slab in allocator.slabs() {
+        for strategy in [FreeStrategy::AddressEquality, FreeStrategy::IndexDecode] {
+            let mut tier = slab.clone();
+            tier.set_address_cache(AddressCache::Eager);
+            tier.set_free_strategy(strategy);
+            let name = format!("slab_free/{}/{strategy:?}", slab.block_size());
+            counts.push((name, count(|| tier.free(&ptr))));
+        }
+        let mut grouped = slab.clone();
+        grouped.set_selection_mode(SelectionMode::Grouped);
+        let name = format!("slab_free/{}/Grouped", slab.block_size());
+        counts.push((name, count(|| grouped.free(&ptr))));
+    }
+
+    let widest = allocator
+        .slabs()
+        .iter()
+        .max_by_key(|slab| slab.num_blocks())
+        .expect("default layout has slab tiers");
+    for mode in [
+        SelectionMode::Linear,
+        SelectionMode::PrefixOr,
+        SelectionMode::Grouped,
+    ] {
+        let mut tier = widest.clone();
+        tier.set_selection_mode(mode);
+        let name = format!("slab_allocate/{}/{mode:?}", widest.num_blocks());
+        counts.push((name, count(|| tier.allocate_masked(&keys.enc_true()))));
+    }
+
+    for (name, pbs) in &counts {
+        println!("{name} {pbs}");
+    }
+
+    let lookup: HashMap<&str, u64> = counts
+        .iter()
+        .map(|(name, pbs)| (name.as_str(), *pbs))
+        .collect();
+    assert_eq!(
+        lookup["free/hit"], lookup["free/miss"],
+        "free cost depends on the pointer"
+    );
+    assert_eq!(
+        lookup["reallocate/stay"], lookup["reallocate/move"],
+        "reallocate cost depends on whether the block moves"
+    );
+    let per_request: Vec<u64> = batches
+        .iter()
+        .map(|batch| lookup[format!("allocate_many/{batch}").as_str()] / *batch as u64)
+        .collect();
+    assert!(
+        per_request.windows(2).all(|pair| pair[1] < pair[0]),
+        "allocate_many does not amortize its per-request cost: {per_request:?}"
+    );
+    let allocate_costs: Vec<u64> = counts
+        .iter()
+        .filter(|(name, _)| name.starts_with("allocate/"))
+        .map(|(_, pbs)| *pbs)
+        .collect();
+    assert!(
+        allocate_costs.windows(2).all(|pair| pair[0] == pair[1]),
+        "allocate cost depends on the requested size"
+    );
+
+    support::gate_on_baseline("CRYPTMALLOC_PBS_BASELINE", "PBS", &lookup);
+}
@@ -0,0 +1,40 @@
+//! Scaffolding shared by the counting benches: a warmed-up allocator to count on and the gate against an earlier run's counts.
+
+use cryptmalloc::CryptMalloc;
+use std::{collections::HashMap, env, fs, process};
+
+/// a default allocator over a 1 MiB arena that has already served one request; the first scan fills each tier's lazy address table, so later counts are steady-state.
+pub fn warmed_allocator() -> CryptMalloc {
+    let mut allocator = CryptMalloc::new(1 << 20);
+    allocator.allocate(allocator.keys().enc_u64(0));
+    allocator
+}
+
+/// when the environment variable `var` names a file of earlier `name count ...` lines, exits with status 1 if any operation in `current` now counts more `unit` than its baseline, and with status 2 if the file cannot be read.
+pub fn gate_on_baseline(var: &str, unit: &str, current: &HashMap<&str, u64>) {
+    let Ok(path) = env::var(var) else {
+        return;
+    };
+    let baseline = fs::read_to_string(&path).unwrap_or_else(|err| {
+        eprintln!("cannot read baseline {path}: {err}");
+        process::exit(2);
+    });
+    let mut regressed = false;
+    for line in baseline.lines() {
+        let mut fields = line.split_whitespace();
+        let (Some(name), Some(Ok(expected))) =
+            (fields.next(), fields.next().map(str::parse::<u64>))
+        else {
+            continue;
+        };
+        if let Some(&actual) = current.get(name) {
+            if actual > expected {
+                eprintln!("{name}: {actual} {unit}, baseline {expected}");
+                regressed = true;
+            }
+        }
+    }
+    if regressed {
+        process::exit(1);
+    }
+}
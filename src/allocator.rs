@@ -1,187 +1,968 @@
-use core::fmt;
+//! CryptMalloc routes encrypted size requests across a fixed table of `N` slab tiers (the five `SIZE_CLASSES` by default) and an overflow arena.
+//! With the `gpu` feature and keys from `Keys::new_on_gpu`, every scan runs on the CUDA server key and the resident ciphertexts live on the device.
+//! Public by design: the tier table, every block size and count, the tier base addresses and the arena bounds, all of which follow from `new`'s arguments; these enter the circuit as scalar operands. Encrypted: request sizes, pointers, occupancy bits and the arena cursor.
+
 use crate::{
     arena::Arena,
     encrypted_option::EncryptedOption,
     encrypted_ptr::EncryptedPtr,
-    keys::Keys,
-    slab::SlabClass,
+    keys::{invalid_data, Keys, ParameterProfile, TableConstruction},
+    metrics::{self, Phase},
+    packed::BitmapLayout,
+    scan::SelectionMode,
+    slab::{AddressCache, Release, SlabClass},
+    snapshot::{SnapshotReader, SnapshotWriter},
+    word::{word_holds, PtrWord},
+};
+use core::{array, fmt};
+use rayon::prelude::*;
+use std::{
+    io::{self, Read, Write},
+    ops::Range,
 };
-use std::ops::Not;
-use tfhe::{prelude::*, set_server_key, FheBool, FheUint64};
+use tfhe::{FheBool, FheUint64};
+
+/// decides how `allocate` schedules the slab scans and the arena bump; both modes run every sub-allocation and decrypt to the same pointer.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum RoutingMode {
+    /// one sub-allocation after another on the calling thread, folded left to right.
+    #[default]
+    Sequential,
+    /// all sub-allocations at once on the rayon pool, folded with a balanced `combine_with` tree; latency tracks the slowest tier.
+    Parallel,
+}
+
+/// decides how much of each tier's reserved block range holds resident ciphertexts; addresses always follow the full tier table, so growth never moves a block and results never depend on the policy.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum TierGrowth {
+    /// every block's flag and table entry exists from construction on.
+    #[default]
+    Eager,
+    /// tiers start empty and grow in whole chunks of this many blocks: before each request a tier grows until it holds at least as many blocks as the allocator has served requests, capped at its reserved count.
+    /// The request count is public and bounds how many blocks any one tier can have handed out, so a chunked tier never turns away a request the eager layout would serve; frees do not lower it, since a free that matches nothing looks the same as one that does.
+    Chunked(usize),
+}
+
+impl TierGrowth {
+    /// blocks a tier reserving `reserved` keeps resident once `requests` requests have been served.
+    pub fn capacity(self, reserved: usize, requests: u64) -> usize {
+        match self {
+            Self::Eager => reserved,
+            Self::Chunked(chunk) => {
+                let chunk = chunk.max(1) as u64;
+                let wanted = requests.div_ceil(chunk).saturating_mul(chunk);
+                usize::try_from(wanted).map_or(reserved, |wanted| wanted.min(reserved))
+            }
+        }
+    }
+}
+
+/// routing outcome for one request: a one-hot tier mask per slab plus the arena flag and the size the arena should bump by (zero when unused).
+struct Route<const N: usize, W> {
+    masks: [FheBool; N],
+    use_arena: FheBool,
+    arena_size: W,
+}
+
+impl<const N: usize, W: PtrWord> Route<N, W> {
+    /// withdraws the request unless `condition` holds: no tier fires and the arena bumps by zero.
+    fn only_if(mut self, condition: &FheBool, zero: &W) -> Self {
+        for mask in self.masks.iter_mut() {
+            *mask &= condition;
+        }
+        self.use_arena &= condition;
+        self.arena_size = W::select(condition, &self.arena_size, zero);
+        self
+    }
+}
 
-pub struct CryptMalloc {
+/// `N` is the number of slab tiers and `W` the pointer word; `CryptMalloc` alone means the default five-tier layout on `FheUint64`.
+pub struct CryptMalloc<const N: usize = 5, W = FheUint64> {
+    tiers: [(usize, usize); N],
     keys: Keys,
-    slabs: Vec<SlabClass>,
-    arena: Arena,
+    slabs: Vec<SlabClass<W>>,
+    arena: Arena<W>,
     enc_false: FheBool,
-    enc_zero_u64: FheUint64,
-    size_bounds: [FheUint64; 5],
+    enc_zero_u64: W,
+    construction: TableConstruction,
+    growth: TierGrowth,
+    requests_served: u64,
+    routing_mode: RoutingMode,
+    pending_frees: Vec<EncryptedPtr<W>>,
+    free_queue_limit: usize,
+}
+
+/// public `(block_size, num_blocks)` layout of the slab tiers, smallest first; a request routes to the first tier whose block size covers it.
+pub const SIZE_CLASSES: [(usize, usize); 5] =
+    [(16, 1024), (32, 512), (64, 256), (128, 128), (256, 64)];
+
+/// arena request sizes round up to a multiple of this many bytes, the default `Heap` word, so chunks bumped one after another stay word-aligned whenever the arena starts on a word.
+pub const ARENA_ALIGN: u64 = 8;
+
+/// queue length at which `free_deferred` flushes on its own.
+pub const DEFAULT_FREE_QUEUE_LIMIT: usize = 32;
+
+/// public, data-independent cost profile of a tier layout; every allocate scans every block of every tier and every free touches each block once, so these counts fix the per-call work.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct LayoutCost {
+    /// blocks visited by each allocate and each free.
+    pub blocks_scanned: usize,
+    /// scalar comparisons spent routing one request.
+    pub routing_comparisons: usize,
+    /// occupancy flags plus offset table entries; a cached address table adds one more per block.
+    pub resident_ciphertexts: usize,
+    /// bytes the slab tiers can hand out before requests fall through to the arena.
+    pub slab_capacity: u64,
+    /// largest gap between a request and the block serving it, e.g. 15 bytes when 17 lands in a 32-byte block.
+    pub worst_case_waste: usize,
+}
+
+impl LayoutCost {
+    pub fn of(tiers: &[(usize, usize)]) -> Self {
+        let blocks_scanned = tiers.iter().map(|&(_, num_blocks)| num_blocks).sum();
+        let slab_capacity = slab_bytes(tiers).expect("slab tiers overflow a 64-bit address space");
+        let worst_case_waste = tiers
+            .iter()
+            .scan(0, |covered, &(block_size, _)| {
+                let waste = block_size.saturating_sub(*covered + 1);
+                *covered = block_size;
+                Some(waste)
+            })
+            .max()
+            .unwrap_or(0);
+        Self {
+            blocks_scanned,
+            routing_comparisons: tiers.len(),
+            resident_ciphertexts: 2 * blocks_scanned,
+            slab_capacity,
+            worst_case_waste,
+        }
+    }
 }
 
-impl fmt::Debug for CryptMalloc {
+impl<const N: usize, W> fmt::Debug for CryptMalloc<N, W> {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         f.debug_struct("CryptMalloc")
-            .field("slab_count", &self.slabs.len())
+            .field("tiers", &self.tiers)
             .field("arena", &self.arena)
+            .field("growth", &self.growth)
+            .field("requests_served", &self.requests_served)
+            .field("routing_mode", &self.routing_mode)
+            .field("pending_frees", &self.pending_frees.len())
             .finish()
     }
 }
 
 impl CryptMalloc {
     /// cryptmalloc wires together the strict top-level allocator: it alone owns the client key, manufactures the encrypted constants plus lookup tables, and lays out the slab tiers contiguously before the arena.
+    /// Generates fresh keys and encrypted tables; see `with_keys` to reuse persisted keys and `with_table_construction` for trivial tables.
     pub fn new(arena_size: u64) -> Self {
-        let keys = Keys::new();
-        let server_key = keys.server_key();
-        set_server_key(server_key.clone());
+        Self::with_keys(Keys::new(), arena_size)
+    }
+
+    /// generates keys under a named parameter profile; see `ParameterProfile` for what each one trades.
+    pub fn with_profile(profile: ParameterProfile, arena_size: u64) -> Self {
+        Self::with_keys(Keys::with_profile(profile), arena_size)
+    }
+
+    /// builds the allocator around existing keys, e.g. from `Keys::load_or_generate`, so construction skips key generation.
+    pub fn with_keys(keys: Keys, arena_size: u64) -> Self {
+        Self::with_table_construction(keys, arena_size, TableConstruction::default())
+    }
+
+    /// like `with_keys`, but picks how the slab lookup tables are produced; `TableConstruction::Trivial` makes construction nearly free when the tier layout need not look like secret data.
+    pub fn with_table_construction(
+        keys: Keys,
+        arena_size: u64,
+        construction: TableConstruction,
+    ) -> Self {
+        Self::with_layout(keys, SIZE_CLASSES, arena_size, construction)
+    }
+}
+
+impl<const N: usize, W: PtrWord> CryptMalloc<N, W> {
+    /// builds an allocator over a custom `(block_size, num_blocks)` tier table, laid out contiguously in the given order before the arena.
+    /// Tiers must have strictly increasing, non-zero block sizes and at least one block each; `LayoutCost::of` previews the per-call work of a table.
+    /// The pointer word `W` must represent the heap end (slab bytes plus `arena_size`); `narrowest_pointer_bits` names the cheapest width that does, and narrower words cut the cost of every comparison, add and mux.
+    pub fn with_layout(
+        keys: Keys,
+        tiers: [(usize, usize); N],
+        arena_size: u64,
+        construction: TableConstruction,
+    ) -> Self {
+        Self::with_base(keys, tiers, 0, arena_size, construction)
+    }
+
+    /// `with_layout` with the heap starting at `heap_base` instead of zero, e.g. to give several allocators disjoint public address ranges; the pointer word must represent the heap end.
+    pub fn with_base(
+        keys: Keys,
+        tiers: [(usize, usize); N],
+        heap_base: u64,
+        arena_size: u64,
+        construction: TableConstruction,
+    ) -> Self {
+        Self::assemble(
+            keys,
+            tiers,
+            heap_base,
+            arena_size,
+            construction,
+            TierGrowth::Eager,
+            tiers.map(|(_, num_blocks)| num_blocks),
+        )
+    }
+
+    /// `with_layout` under a tier growth policy; with `TierGrowth::Chunked` construction builds no flags or tables at all, and memory and table-building time then track the requests actually served.
+    pub fn with_growth(
+        keys: Keys,
+        tiers: [(usize, usize); N],
+        arena_size: u64,
+        construction: TableConstruction,
+        growth: TierGrowth,
+    ) -> Self {
+        Self::assemble(
+            keys,
+            tiers,
+            0,
+            arena_size,
+            construction,
+            growth,
+            tiers.map(|(_, num_blocks)| growth.capacity(num_blocks, 0)),
+        )
+    }
+
+    /// lays the tiers out by their reserved counts but materializes only `capacities[t]` blocks of tier `t`.
+    #[allow(clippy::too_many_arguments)]
+    fn assemble(
+        keys: Keys,
+        tiers: [(usize, usize); N],
+        heap_base: u64,
+        arena_size: u64,
+        construction: TableConstruction,
+        growth: TierGrowth,
+        capacities: [usize; N],
+    ) -> Self {
+        const { assert!(N > 0, "a layout needs at least one slab tier") };
+        if let Some(problem) = layout_problem(&tiers, W::BITS) {
+            panic!("{problem}");
+        }
+        let heap_end = slab_bytes(&tiers)
+            .and_then(|bytes| bytes.checked_add(heap_base))
+            .and_then(|end| end.checked_add(arena_size))
+            .expect("the heap overflows a 64-bit address space");
+        assert!(
+            word_holds(heap_end, W::BITS),
+            "a heap ending at {heap_end} does not fit a {}-bit pointer word",
+            W::BITS
+        );
+
+        let context = keys.context().clone();
+        let _guard = context.enter();
 
         let enc_false = keys.enc_false();
         let enc_true = keys.enc_true();
         let enc_zero_u32 = keys.enc_zero_u32();
-        let enc_zero_u64 = keys.enc_zero_u64();
-        let size_bounds = [
-            keys.enc_u64(16),
-            keys.enc_u64(32),
-            keys.enc_u64(64),
-            keys.enc_u64(128),
-            keys.enc_u64(256),
-        ];
-
-        let slab_configs = [
-            (16usize, 1024usize),
-            (32usize, 512usize),
-            (64usize, 256usize),
-            (128usize, 128usize),
-            (256usize, 64usize),
-        ];
-
-        let mut slabs = Vec::with_capacity(slab_configs.len());
-        let mut running_offset = 0u64;
-
-        for (block_size, num_blocks) in slab_configs.iter() {
-            let base_offset_plain = running_offset;
-            running_offset += (*block_size as u64) * (*num_blocks as u64);
+        let enc_zero_u64: W = keys.enc_word(0);
 
-            let base_offset = keys.enc_u64(base_offset_plain);
-            let enc_indices_u32 = keys.build_enc_indices_u32(*num_blocks);
-            let enc_offsets_u64 = keys.build_enc_offsets_u64(*num_blocks, *block_size);
+        let tables: Vec<_> = tiers
+            .par_iter()
+            .zip(capacities.par_iter())
+            .map(|(&(block_size, _), &capacity)| {
+                keys.build_tables(0..capacity, block_size, construction)
+            })
+            .collect();
+
+        let mut slabs = Vec::with_capacity(N);
+        let mut running_offset = heap_base;
+
+        for (((block_size, num_blocks), capacity), enc_offsets_u64) in
+            tiers.iter().zip(capacities).zip(tables)
+        {
+            let base_offset = running_offset;
+            running_offset += (*block_size as u64) * (*num_blocks as u64);
 
             let slab = SlabClass::new(
                 *block_size,
-                *num_blocks,
+                capacity,
                 base_offset,
-                server_key.clone(),
+                context.clone(),
                 enc_false.clone(),
                 enc_true.clone(),
                 enc_zero_u32.clone(),
                 enc_zero_u64.clone(),
-                enc_indices_u32,
                 enc_offsets_u64,
             );
 
             slabs.push(slab);
         }
 
-        let arena_start_plain = running_offset;
-        let arena_end_plain = arena_start_plain + arena_size;
-        let arena_start = keys.enc_u64(arena_start_plain);
-        let arena_end = keys.enc_u64(arena_end_plain);
+        let arena_start = running_offset;
+        let arena_end = heap_end;
         let arena_enc_false = enc_false.clone();
         let arena_enc_zero = enc_zero_u64.clone();
 
         let arena = Arena::new(
             arena_start,
             arena_end,
-            server_key.clone(),
+            context.clone(),
             arena_enc_false,
             arena_enc_zero,
         );
 
-        Self {
+        #[cfg_attr(not(feature = "gpu"), allow(unused_mut))]
+        let mut allocator = Self {
+            tiers,
             keys,
             slabs,
             arena,
             enc_false,
             enc_zero_u64,
-            size_bounds,
+            construction,
+            growth,
+            requests_served: 0,
+            routing_mode: RoutingMode::default(),
+            pending_frees: Vec::new(),
+            free_queue_limit: DEFAULT_FREE_QUEUE_LIMIT,
+        };
+        #[cfg(feature = "gpu")]
+        if context.on_gpu() {
+            allocator.move_to_current_device();
         }
+        allocator
     }
 
-    /// routes encrypted size requests through every slab class plus the arena in constant time; sizes up to 256 bytes never spill into the arena, and zero length requests are coerced to 16 bytes before routing
-    pub fn allocate(&mut self, size: FheUint64) -> EncryptedOption<EncryptedPtr> {
-        set_server_key(self.keys.server_key());
-
-        let enc_false = self.enc_false.clone();
-        let enc_zero = self.enc_zero_u64.clone();
-        let enc_16 = self.size_bounds[0].clone();
-        let enc_32 = self.size_bounds[1].clone();
-        let enc_64 = self.size_bounds[2].clone();
-        let enc_128 = self.size_bounds[3].clone();
-        let enc_256 = self.size_bounds[4].clone();
+    /// moves every resident ciphertext (bitmaps, tables, arena state, constants) onto the CUDA device of the key context; `with_layout` already does this for GPU keys.
+    /// Tables built later, such as lazily cached addresses or a repacked bitmap, come out of GPU operations and are resident from the start.
+    #[cfg(feature = "gpu")]
+    pub fn move_to_current_device(&mut self) {
+        let _guard = self.keys.context().enter();
+        self.slabs
+            .iter_mut()
+            .for_each(|slab| slab.move_to_current_device());
+        self.arena.move_to_current_device();
+        self.enc_false.move_to_current_device();
+        self.enc_zero_u64.move_to_current_device();
+    }
 
-        let is_zero = size.eq(&enc_zero);
-        let lt_16 = size.lt(&enc_16);
-        let force_16 = (&is_zero) | (&lt_16);
-        let size_ct = force_16.if_then_else(&enc_16, &size);
+    /// routes encrypted size requests through every slab class plus the arena in constant time; sizes up to the largest block size never spill into the arena, and zero length requests are served by the smallest tier; larger sizes take an arena chunk rounded up to `ARENA_ALIGN` bytes.
+    pub fn allocate(&mut self, size: W) -> EncryptedOption<EncryptedPtr<W>> {
+        let _guard = self.keys.context().enter();
+        metrics::phase(Phase::Allocate, None, || self.allocate_one(size))
+    }
 
-        let fits16 = size_ct.le(&enc_16);
-        let fits32 = size_ct.le(&enc_32);
-        let fits64 = size_ct.le(&enc_64);
-        let fits128 = size_ct.le(&enc_128);
-        let fits256 = size_ct.le(&enc_256);
+    fn allocate_one(&mut self, size: W) -> EncryptedOption<EncryptedPtr<W>> {
+        self.reserve(1);
+        let route = metrics::phase(Phase::Route, None, || self.route(&size));
+        self.serve(route)
+    }
 
-        let mask0 = fits16.clone();
-        let mask1 = fits32.clone() & fits16.clone().not();
-        let used01 = fits16.clone() | fits32.clone();
-        let mask2 = fits64.clone() & used01.clone().not();
-        let used012 = used01.clone() | fits64.clone();
-        let mask3 = fits128.clone() & used012.clone().not();
-        let used0123 = used012.clone() | fits128.clone();
-        let mask4 = fits256.clone() & used0123.clone().not();
+    /// runs every sub-allocation for one routed request under the current routing mode and folds the results.
+    /// The fold starts from the first tier's result instead of a copied `none`: a tier that does not fire already returns the zero pointer, exactly what a `none` seed would have contributed.
+    fn serve(&mut self, route: Route<N, W>) -> EncryptedOption<EncryptedPtr<W>> {
+        let Route {
+            masks,
+            use_arena,
+            arena_size,
+        } = route;
 
-        let masks = [mask0, mask1, mask2, mask3, mask4];
+        if self.routing_mode == RoutingMode::Parallel {
+            return self.allocate_parallel(&masks, arena_size, use_arena);
+        }
 
         let mut slab_results = Vec::with_capacity(self.slabs.len());
-        for (slab, sel) in self.slabs.iter_mut().zip(masks.iter()) {
-            slab_results.push(slab.allocate_masked(sel.clone()));
+        for (tier, (slab, sel)) in self.slabs.iter_mut().zip(masks.iter()).enumerate() {
+            slab_results.push(metrics::phase(Phase::Slab, Some(tier), || {
+                slab.allocate_masked(sel)
+            }));
         }
 
-        let use_arena = size_ct.gt(&enc_256);
-        let arena_size = use_arena.if_then_else(&size_ct, &enc_zero.clone());
-        let arena_raw = self.arena.allocate(arena_size);
+        let arena_raw = metrics::phase(Phase::Arena, None, || self.arena.allocate(arena_size));
         let arena_masked = EncryptedOption {
             value: arena_raw.value,
-            is_some: arena_raw.is_some & use_arena.clone(),
+            is_some: arena_raw.is_some & use_arena,
         };
 
-        let mut result = EncryptedOption::none(EncryptedPtr(enc_zero.clone()), enc_false.clone());
-        for slab_result in slab_results.iter() {
-            result = result.combine_with(slab_result);
+        metrics::phase(Phase::Combine, None, || {
+            let mut results = slab_results.into_iter();
+            let mut result = results.next().expect("a layout has at least one slab tier");
+            for slab_result in results {
+                result.absorb(&slab_result);
+            }
+            result.absorb(&arena_masked);
+            result
+        })
+    }
+
+    /// computes the one-hot tier masks plus the arena request for one size; no tier is skipped and every comparison runs regardless of the size.
+    fn route(&self, size: &W) -> Route<N, W> {
+        let mut masks: [FheBool; N] =
+            array::from_fn(|tier| size.scalar_le(self.tiers[tier].0 as u64));
+        // a size too close to the word maximum to round up cannot be served anywhere, so it leaves the arena out instead of wrapping to zero.
+        let word_max = u64::MAX >> (u64::BITS - W::BITS);
+        let roundable = size.scalar_le(word_max - (ARENA_ALIGN - 1));
+        let use_arena = !&masks[N - 1] & roundable;
+
+        // fits is monotone across tiers, so tier t is chosen exactly when it fits and tier t - 1 does not; going down from the top turns the fits into masks in place, each reading a lower entry before it is rewritten.
+        for tier in (1..N).rev() {
+            let lower_misses = !&masks[tier - 1];
+            masks[tier] &= lower_misses;
+        }
+
+        let aligned = size
+            .scalar_add(ARENA_ALIGN - 1)
+            .scalar_bitand(!(ARENA_ALIGN - 1));
+        let arena_size = W::select(&use_arena, &aligned, &self.enc_zero_u64);
+
+        Route {
+            masks,
+            use_arena,
+            arena_size,
+        }
+    }
+
+    /// moves a block to fit `new_size`, C `realloc` style, in one fixed pass: a pointer whose slab tier already covers `new_size` comes back unchanged, otherwise a fresh block is allocated and the old one released.
+    /// When no new block is available the result is `none` and the old block stays allocated; arena chunks always move, since the arena keeps no chunk lengths to grow in place.
+    /// The allocator tracks addresses only; `Heap::memcpy` moves the contents when their length is public. Every call runs one routing and one pointer decode per tier whatever the outcome, and each tier writes the new block and the old block's release back in the same pass.
+    pub fn reallocate(
+        &mut self,
+        ptr: &EncryptedPtr<W>,
+        new_size: W,
+    ) -> EncryptedOption<EncryptedPtr<W>> {
+        let _guard = self.keys.context().enter();
+        metrics::phase(Phase::Reallocate, None, || {
+            self.reallocate_one(ptr, new_size)
+        })
+    }
+
+    fn reallocate_one(
+        &mut self,
+        ptr: &EncryptedPtr<W>,
+        new_size: W,
+    ) -> EncryptedOption<EncryptedPtr<W>> {
+        self.reserve(1);
+        let route = metrics::phase(Phase::Route, None, || self.route(&new_size));
+
+        // each tier decodes the pointer once; the flag says whether the block stays, the rest is the release folded into the tier's write-back.
+        let releases: Vec<Release<W>> = self
+            .slabs
+            .par_iter_mut()
+            .map(|slab| slab.locate_release(ptr))
+            .collect();
+
+        // the block stays put exactly when it lives in the tier new_size routes to.
+        let stays = releases
+            .iter()
+            .zip(route.masks.iter())
+            .map(|(release, mask)| release.in_tier() & mask)
+            .reduce(|left, right| left | right)
+            .unwrap_or_else(|| self.enc_false.clone());
+
+        let Route {
+            masks,
+            use_arena,
+            arena_size,
+        } = route.only_if(&!&stays, &self.enc_zero_u64);
+        let slabs = &mut self.slabs;
+        let arena = &mut self.arena;
+        let (claimed, arena_raw) = rayon::join(
+            || {
+                slabs
+                    .par_iter_mut()
+                    .zip(masks.par_iter())
+                    .enumerate()
+                    .map(|(tier, (slab, sel))| {
+                        metrics::phase(Phase::Slab, Some(tier), || slab.claim_masked(sel))
+                    })
+                    .collect::<Vec<_>>()
+            },
+            || metrics::phase(Phase::Arena, None, || arena.allocate(arena_size)),
+        );
+
+        let (mut results, claims): (Vec<_>, Vec<_>) = claimed.into_iter().unzip();
+        results.push(EncryptedOption {
+            value: arena_raw.value,
+            is_some: arena_raw.is_some & use_arena,
+        });
+        let moved = metrics::phase(Phase::Combine, None, || {
+            EncryptedOption::combine_balanced(results, self.keys.context()).unwrap_or_else(|| {
+                EncryptedOption::none(
+                    EncryptedPtr(self.enc_zero_u64.clone()),
+                    self.enc_false.clone(),
+                )
+            })
+        });
+
+        // the heap end is no chunk start, so releasing it in the arena is a constant-time no-op.
+        let heap_end = W::trivial_word(self.arena.end());
+        let arena_release = EncryptedPtr(W::select(&moved.is_some, &ptr.0, &heap_end));
+        let slabs = &mut self.slabs;
+        let arena = &mut self.arena;
+        metrics::phase(Phase::Free, None, || {
+            rayon::join(
+                || {
+                    slabs
+                        .par_iter_mut()
+                        .zip(claims)
+                        .zip(releases.par_iter())
+                        .for_each(|((slab, claim), release)| {
+                            slab.write_claim(claim, Some((release, &moved.is_some)))
+                        })
+                },
+                || arena.free(&arena_release),
+            )
+        });
+
+        EncryptedOption {
+            value: EncryptedPtr(W::select(&stays, &ptr.0, &moved.value.0)),
+            is_some: &stays | &moved.is_some,
+        }
+    }
+
+    /// allocates room for `count` elements of a public `element_size` bytes each; a product that overflows the pointer word yields `none` and allocates nothing.
+    /// The allocator tracks addresses only; `Heap::zero` clears the block under the result's `is_some`.
+    pub fn calloc(&mut self, count: W, element_size: u64) -> EncryptedOption<EncryptedPtr<W>> {
+        let _guard = self.keys.context().enter();
+        metrics::phase(Phase::Calloc, None, || {
+            self.reserve(1);
+            let word_max = u64::MAX >> (u64::BITS - W::BITS);
+            let fits = count.scalar_le(word_max.checked_div(element_size).unwrap_or(word_max));
+            let total = count.scalar_mul(element_size);
+            let route = metrics::phase(Phase::Route, None, || self.route(&total));
+            self.serve(route.only_if(&fits, &self.enc_zero_u64))
+        })
+    }
+
+    /// routes a burst of requests at once: every tier compacts its free blocks once and serves all of them with one write-back, and the arena bumps its share in order.
+    /// A tier's compaction costs a fixed number of PBS for its size, so the per-request cost falls as the batch grows; `benches/pbs_counts.rs` prints it at several batch sizes.
+    /// The whole batch runs the same fixed work whatever the sizes are; within one tier, requests are served in batch order exactly as consecutive `allocate` calls would be.
+    pub fn allocate_many(&mut self, sizes: &[W]) -> Vec<EncryptedOption<EncryptedPtr<W>>> {
+        let _guard = self.keys.context().enter();
+        metrics::phase(Phase::AllocateMany, None, || {
+            self.allocate_routed_batch(sizes)
+        })
+    }
+
+    fn allocate_routed_batch(&mut self, sizes: &[W]) -> Vec<EncryptedOption<EncryptedPtr<W>>> {
+        self.reserve(sizes.len());
+        let context = self.keys.context().clone();
+
+        let routes: Vec<Route<N, W>> = metrics::phase(Phase::Route, None, || {
+            sizes
+                .par_iter()
+                .map(|size| {
+                    context.install();
+                    self.route(size)
+                })
+                .collect()
+        });
+
+        // transpose the routes into per-tier mask columns by moving each flag, so no route is copied.
+        let mut tier_masks: Vec<Vec<FheBool>> =
+            (0..N).map(|_| Vec::with_capacity(sizes.len())).collect();
+        let mut arena_sizes = Vec::with_capacity(sizes.len());
+        let mut use_arena = Vec::with_capacity(sizes.len());
+        for route in routes {
+            for (column, mask) in tier_masks.iter_mut().zip(route.masks) {
+                column.push(mask);
+            }
+            arena_sizes.push(route.arena_size);
+            use_arena.push(route.use_arena);
+        }
+
+        let slabs = &mut self.slabs;
+        let arena = &mut self.arena;
+        let (tier_results, arena_results) = rayon::join(
+            || {
+                slabs
+                    .par_iter_mut()
+                    .zip(tier_masks.par_iter())
+                    .enumerate()
+                    .map(|(tier, (slab, masks))| {
+                        metrics::phase(Phase::Slab, Some(tier), || slab.allocate_batch(masks))
+                    })
+                    .collect::<Vec<_>>()
+            },
+            || metrics::phase(Phase::Arena, None, || arena.allocate_many(&arena_sizes)),
+        );
+
+        let mut per_tier: Vec<_> = tier_results.into_iter().map(Vec::into_iter).collect();
+        let mut per_request = Vec::with_capacity(sizes.len());
+        for (use_arena, arena_raw) in use_arena.into_iter().zip(arena_results) {
+            let mut options: Vec<EncryptedOption<EncryptedPtr<W>>> = Vec::with_capacity(N + 1);
+            options.extend(per_tier.iter_mut().filter_map(Iterator::next));
+            options.push(EncryptedOption {
+                value: arena_raw.value,
+                is_some: arena_raw.is_some & use_arena,
+            });
+            per_request.push(options);
+        }
+
+        metrics::phase(Phase::Combine, None, || {
+            per_request
+                .into_par_iter()
+                .map(|options| {
+                    EncryptedOption::combine_balanced(options, &context).unwrap_or_else(|| {
+                        EncryptedOption::none(
+                            EncryptedPtr(self.enc_zero_u64.clone()),
+                            self.enc_false.clone(),
+                        )
+                    })
+                })
+                .collect()
+        })
+    }
+
+    /// runs the slab scans and the arena bump as independent rayon tasks; each sub-allocator enters the shared key context on whichever worker picks it up.
+    /// The balanced fold needs no leading `none`: a tier that does not fire already returns the zero pointer, so the outcome matches the sequential chain.
+    fn allocate_parallel(
+        &mut self,
+        masks: &[FheBool],
+        arena_size: W,
+        use_arena: FheBool,
+    ) -> EncryptedOption<EncryptedPtr<W>> {
+        let slabs = &mut self.slabs;
+        let arena = &mut self.arena;
+
+        let (mut results, arena_raw) = rayon::join(
+            || {
+                slabs
+                    .par_iter_mut()
+                    .zip(masks.par_iter())
+                    .enumerate()
+                    .map(|(tier, (slab, sel))| {
+                        metrics::phase(Phase::Slab, Some(tier), || slab.allocate_masked(sel))
+                    })
+                    .collect::<Vec<_>>()
+            },
+            || metrics::phase(Phase::Arena, None, || arena.allocate(arena_size)),
+        );
+
+        results.push(EncryptedOption {
+            value: arena_raw.value,
+            is_some: arena_raw.is_some & use_arena,
+        });
+
+        metrics::phase(Phase::Combine, None, || {
+            EncryptedOption::combine_balanced(results, self.keys.context()).unwrap_or_else(|| {
+                EncryptedOption::none(
+                    EncryptedPtr(self.enc_zero_u64.clone()),
+                    self.enc_false.clone(),
+                )
+            })
+        })
+    }
+
+    /// counts `requests` more served requests and grows every tier to what the growth policy allows for the new count; only public counts decide how far.
+    fn reserve(&mut self, requests: usize) {
+        self.requests_served += requests as u64;
+        self.materialize();
+    }
+
+    fn materialize(&mut self) {
+        let keys = &self.keys;
+        let (growth, construction, served) = (self.growth, self.construction, self.requests_served);
+        self.slabs
+            .par_iter_mut()
+            .zip(self.tiers.par_iter())
+            .for_each(|(slab, &(block_size, reserved))| {
+                let capacity = growth.capacity(reserved, served);
+                if capacity > slab.num_blocks() {
+                    let offsets =
+                        keys.build_tables(slab.num_blocks()..capacity, block_size, construction);
+                    slab.grow(offsets);
+                    #[cfg(feature = "gpu")]
+                    if keys.context().on_gpu() {
+                        slab.move_to_current_device();
+                    }
+                }
+            });
+    }
+
+    pub fn tier_growth(&self) -> TierGrowth {
+        self.growth
+    }
+
+    /// switches the growth policy; tiers grow right away to what the new policy allows for the requests served so far and never shrink.
+    pub fn set_tier_growth(&mut self, growth: TierGrowth) {
+        self.growth = growth;
+        let _guard = self.keys.context().enter();
+        self.materialize();
+    }
+
+    /// requests seen by `allocate`, `allocate_many`, `reallocate` and `calloc`, successful or not; the public count chunked growth follows.
+    pub fn requests_served(&self) -> u64 {
+        self.requests_served
+    }
+
+    pub fn routing_mode(&self) -> RoutingMode {
+        self.routing_mode
+    }
+
+    pub fn set_routing_mode(&mut self, mode: RoutingMode) {
+        self.routing_mode = mode;
+    }
+
+    /// applies one first-free search strategy to every slab tier; results are identical across modes, only the dependency depth changes.
+    pub fn set_selection_mode(&mut self, mode: SelectionMode) {
+        for slab in self.slabs.iter_mut() {
+            slab.set_selection_mode(mode);
+        }
+    }
+
+    /// applies one absolute-address caching policy to every slab tier; use `Recompute` where ciphertext memory is tighter than free throughput.
+    pub fn set_address_cache(&mut self, policy: AddressCache) {
+        let _guard = self.keys.context().enter();
+        for slab in self.slabs.iter_mut() {
+            slab.set_address_cache(policy);
+        }
+    }
+
+    /// converts every slab tier to one occupancy layout; allocation state is preserved across the conversion.
+    pub fn set_bitmap_layout(&mut self, layout: BitmapLayout) {
+        for slab in self.slabs.iter_mut() {
+            slab.set_bitmap_layout(layout);
         }
-        result = result.combine_with(&arena_masked);
-        result
     }
 
-    pub fn arena(&self) -> &Arena {
-        set_server_key(self.keys.server_key());
+    /// the public address range every pointer this allocator hands out falls into: the slab tiers followed by the arena.
+    pub fn heap_range(&self) -> Range<u64> {
+        let start = self.arena.start() - self.layout_cost().slab_capacity;
+        start..self.arena.end()
+    }
+
+    pub fn tiers(&self) -> &[(usize, usize); N] {
+        &self.tiers
+    }
+
+    pub fn layout_cost(&self) -> LayoutCost {
+        LayoutCost::of(&self.tiers)
+    }
+
+    pub fn arena(&self) -> &Arena<W> {
         &self.arena
     }
 
-    pub fn slabs(&self) -> &[SlabClass] {
-        set_server_key(self.keys.server_key());
+    /// resizes the arena free-list; see `Arena::set_free_list_capacity`.
+    pub fn set_arena_free_list_capacity(&mut self, capacity: usize) {
+        self.arena.set_free_list_capacity(capacity);
+    }
+
+    pub fn slabs(&self) -> &[SlabClass<W>] {
         &self.slabs
     }
 
     pub fn keys(&self) -> &Keys {
-        set_server_key(self.keys.server_key());
         &self.keys
     }
 
-    // frees pointers by scanning every slab in constant time; arena chunks are not freed individually and null/invalid ciphertexts are harmless no-ops.
-    pub fn free(&mut self, ptr: &EncryptedPtr) {
-        set_server_key(self.keys.server_key());
+    // frees pointers by scanning every slab and every arena free-list slot in constant time; null/invalid ciphertexts are harmless no-ops.
+    pub fn free(&mut self, ptr: &EncryptedPtr<W>) {
+        let _guard = self.keys.context().enter();
 
-        for slab in self.slabs.iter_mut() {
-            slab.free(ptr);
+        metrics::phase(Phase::Free, None, || {
+            for (tier, slab) in self.slabs.iter_mut().enumerate() {
+                metrics::phase(Phase::Slab, Some(tier), || slab.free(ptr));
+            }
+            metrics::phase(Phase::Arena, None, || self.arena.free(ptr));
+        });
+    }
+
+    /// queues a pointer for release instead of scanning now; the block stays allocated until the queue flushes, either here once `free_queue_limit` pointers are pending or via `flush_frees`.
+    /// Only the number of queued frees is observable, which the caller's call pattern already reveals.
+    pub fn free_deferred(&mut self, ptr: EncryptedPtr<W>) {
+        self.pending_frees.push(ptr);
+        if self.pending_frees.len() >= self.free_queue_limit {
+            self.flush_frees();
+        }
+    }
+
+    /// releases every queued pointer with one write pass per slab tier and over the arena free-list; the tiers and the arena flush concurrently.
+    pub fn flush_frees(&mut self) {
+        let pending = core::mem::take(&mut self.pending_frees);
+        if pending.is_empty() {
+            return;
+        }
+        let _guard = self.keys.context().enter();
+
+        let slabs = &mut self.slabs;
+        let arena = &mut self.arena;
+        metrics::phase(Phase::FlushFrees, None, || {
+            rayon::join(
+                || {
+                    slabs.par_iter_mut().enumerate().for_each(|(tier, slab)| {
+                        metrics::phase(Phase::Slab, Some(tier), || slab.free_batch(&pending))
+                    })
+                },
+                || metrics::phase(Phase::Arena, None, || arena.free_batch(&pending)),
+            )
+        });
+    }
+
+    pub fn pending_frees(&self) -> usize {
+        self.pending_frees.len()
+    }
+
+    pub fn free_queue_limit(&self) -> usize {
+        self.free_queue_limit
+    }
+
+    /// sets the auto-flush threshold (at least one) and flushes right away if the queue already reached it.
+    pub fn set_free_queue_limit(&mut self, limit: usize) {
+        self.free_queue_limit = limit.max(1);
+        if self.pending_frees.len() >= self.free_queue_limit {
+            self.flush_frees();
+        }
+    }
+
+    /// streams the allocator state to `writer` in the versioned format of the `snapshot` module: the public layout as a header, then every tier's occupancy bits, the arena cursor and free-list, and the queued frees as compressed ciphertext lists.
+    /// Keys are not part of the stream (persist them with `Keys::save`), and neither are the lookup tables, whose entries are public layout values that `restore` rebuilds as trivial ciphertexts; the keys need compression enabled, which every `Keys` constructor does.
+    pub fn snapshot(&self, writer: impl Write) -> io::Result<()> {
+        let _guard = self.keys.context().enter();
+        let mut out = SnapshotWriter::new(writer, W::BITS)?;
+
+        out.write_u64(N as u64)?;
+        for (slab, &(_, reserved)) in self.slabs.iter().zip(&self.tiers) {
+            out.write_u64(slab.block_size() as u64)?;
+            out.write_u64(reserved as u64)?;
+            out.write_u64(slab.num_blocks() as u64)?;
+            out.write_u64(match slab.bitmap_layout() {
+                BitmapLayout::Flags => 0,
+                BitmapLayout::Packed => 1,
+            })?;
+        }
+        out.write_u64(self.arena.start())?;
+        out.write_u64(self.arena.end())?;
+        out.write_u64(self.arena.free_list_capacity() as u64)?;
+        out.write_u64(self.pending_frees.len() as u64)?;
+        out.write_u64(match self.growth {
+            TierGrowth::Eager => 0,
+            TierGrowth::Chunked(chunk) => chunk.max(1) as u64,
+        })?;
+        out.write_u64(self.requests_served)?;
+
+        for slab in &self.slabs {
+            slab.write_snapshot(&mut out)?;
+        }
+        self.arena.write_snapshot(&mut out)?;
+        out.write_section(self.pending_frees.iter().map(|ptr| ptr.0.clone()))?;
+        out.finish()
+    }
+
+    /// rebuilds an allocator from a `snapshot` stream on `keys`, which must be the keys the snapshot was taken under; the reader is consumed one compressed list at a time.
+    /// Only allocator state travels, counting the tier growth policy and the requests served, which fix how many blocks each tier holds; routing, selection, caching and free-strategy settings and the free queue limit come back at their defaults.
+    pub fn restore(keys: Keys, reader: impl Read) -> io::Result<Self> {
+        let mut input = SnapshotReader::new(reader, W::BITS)?;
+
+        if input.read_len()? != N {
+            return Err(invalid_data(format!(
+                "snapshot does not hold {N} slab tiers"
+            )));
+        }
+        let mut tiers = [(0, 0); N];
+        let mut capacities = [0; N];
+        let mut layouts = [BitmapLayout::Flags; N];
+        for ((tier, capacity), layout) in tiers
+            .iter_mut()
+            .zip(capacities.iter_mut())
+            .zip(layouts.iter_mut())
+        {
+            *tier = (input.read_len()?, input.read_len()?);
+            *capacity = input.read_len()?;
+            if *capacity > tier.1 {
+                return Err(invalid_data(
+                    "snapshot materializes more blocks than a tier reserves",
+                ));
+            }
+            *layout = match input.read_u64()? {
+                0 => BitmapLayout::Flags,
+                1 => BitmapLayout::Packed,
+                other => return Err(invalid_data(format!("unknown bitmap layout {other}"))),
+            };
+        }
+        if let Some(problem) = layout_problem(&tiers, W::BITS) {
+            return Err(invalid_data(problem));
+        }
+        let (arena_start, arena_end) = (input.read_u64()?, input.read_u64()?);
+        let slab_bytes = LayoutCost::of(&tiers).slab_capacity;
+        if arena_start < slab_bytes || arena_end < arena_start {
+            return Err(invalid_data(
+                "snapshot arena bounds do not follow its tiers",
+            ));
+        }
+        if W::BITS < u64::BITS && arena_end >> W::BITS != 0 {
+            return Err(invalid_data("snapshot heap does not fit the pointer word"));
+        }
+        let free_list_capacity = input.read_len()?;
+        let pending_frees = input.read_len()?;
+        let growth = match input.read_len()? {
+            0 => TierGrowth::Eager,
+            chunk => TierGrowth::Chunked(chunk),
+        };
+        let requests_served = input.read_u64()?;
+
+        // every tier's bits are read before any tier is built, so a header claiming more blocks than the stream holds fails at the end of the stream instead of allocating for them.
+        let context = keys.context().clone();
+        let _guard = context.enter();
+        let mut bits = Vec::with_capacity(N);
+        for ((&(block_size, _), &capacity), &layout) in tiers.iter().zip(&capacities).zip(&layouts)
+        {
+            bits.push(SlabClass::<W>::read_snapshot(
+                &mut input, block_size, capacity, layout,
+            )?);
+        }
+
+        let mut allocator = Self::assemble(
+            keys,
+            tiers,
+            arena_start - slab_bytes,
+            arena_end - arena_start,
+            TableConstruction::Trivial,
+            growth,
+            capacities,
+        );
+        allocator.requests_served = requests_served;
+        for (slab, bits) in allocator.slabs.iter_mut().zip(bits) {
+            slab.restore_snapshot(bits);
+        }
+        allocator
+            .arena
+            .read_snapshot(&mut input, free_list_capacity)?;
+        allocator.pending_frees = input
+            .read_section::<W>(pending_frees)?
+            .into_iter()
+            .map(EncryptedPtr::new)
+            .collect();
+        Ok(allocator)
+    }
+}
+
+/// bytes the slab tiers span together, `None` when that overflows a `u64`.
+pub(crate) fn slab_bytes(tiers: &[(usize, usize)]) -> Option<u64> {
+    tiers
+        .iter()
+        .try_fold(0u64, |total, &(block_size, num_blocks)| {
+            (block_size as u64)
+                .checked_mul(num_blocks as u64)?
+                .checked_add(total)
+        })
+}
+
+/// why `tiers` cannot back an allocator on a `word_bits`-bit pointer word, if it cannot: every tier needs a non-zero block size and count, block sizes must strictly increase, and the tiers must fit the word.
+fn layout_problem(tiers: &[(usize, usize)], word_bits: u32) -> Option<&'static str> {
+    if !tiers
+        .iter()
+        .all(|&(block_size, num_blocks)| block_size > 0 && num_blocks > 0)
+    {
+        return Some("every slab tier needs a non-zero block size and block count");
+    }
+    if !tiers.windows(2).all(|pair| pair[0].0 < pair[1].0) {
+        return Some("slab tiers must be sorted by strictly increasing block size");
+    }
+    match slab_bytes(tiers) {
+        None => Some("slab tiers overflow a 64-bit address space"),
+        Some(bytes) if !word_holds(bytes, word_bits) => {
+            Some("slab tiers do not fit the pointer word")
         }
+        Some(_) => None,
     }
 }
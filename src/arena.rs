@@ -1,87 +1,338 @@
-//! Arena is the encrypted bump allocator backing large (>256 byte) requests; it advances a ciphertext cursor between encrypted `start` and `end` bounds, never frees individual chunks, and only resets wholesale.
+//! Arena is the encrypted bump allocator backing large (>256 byte) requests; it advances a ciphertext cursor between public `start` and `end` bounds and resets wholesale.
+//! The bounds are layout metadata that every caller already knows, so they enter bound checks as scalar operands; only the cursor and request sizes are ciphertexts.
+//! Bumped chunks are recorded in a fixed number of encrypted free-list slots (start, size, tracked, free); `free` marks a matching slot free and `allocate` reuses the first free slot large enough before bumping. Each slot is visited on every call, so neither hit nor miss is observable.
 
-use crate::{encrypted_option::EncryptedOption, encrypted_ptr::EncryptedPtr};
-use std::ops::Not;
-use tfhe::{prelude::*, set_server_key, FheBool, FheUint64, ServerKey};
+use crate::{
+    encrypted_option::EncryptedOption,
+    encrypted_ptr::EncryptedPtr,
+    keys::{invalid_data, KeyContext},
+    scan::{first_set, one_hot_select_by},
+    snapshot::{SnapshotReader, SnapshotWriter},
+    word::PtrWord,
+};
+use rayon::prelude::*;
+use std::{
+    io::{self, Read, Write},
+    ops::Not,
+};
+use tfhe::{FheBool, FheUint64};
 
+/// free-list slots each arena starts with; `set_free_list_capacity(0)` turns the arena back into a pure bump allocator.
+pub const DEFAULT_ARENA_FREE_SLOTS: usize = 8;
+
+/// one free-list slot: the chunk it records plus whether it records anything and whether that chunk is released; an untracked slot is never free.
 #[derive(Clone)]
-pub struct Arena {
-    start: FheUint64,
-    end: FheUint64,
-    cursor: FheUint64,
-    server_key: ServerKey,
+struct ArenaChunk<W> {
+    start: W,
+    size: W,
+    tracked: FheBool,
+    free: FheBool,
+}
+
+/// `W` is the pointer word for the cursor and request sizes; overflow detection wraps at its width, so `end` must be representable in it.
+#[derive(Clone)]
+pub struct Arena<W = FheUint64> {
+    start: u64,
+    end: u64,
+    cursor: W,
+    context: KeyContext,
     enc_false: FheBool,
-    enc_zero_u64: FheUint64,
+    enc_zero_u64: W,
+    chunks: Vec<ArenaChunk<W>>,
 }
 
-impl core::fmt::Debug for Arena {
+impl<W> core::fmt::Debug for Arena<W> {
     fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
         f.debug_struct("Arena")
-            .field("start", &"<ciphertext>")
-            .field("end", &"<ciphertext>")
+            .field("start", &self.start)
+            .field("end", &self.end)
             .field("cursor", &"<ciphertext>")
+            .field("free_list_capacity", &self.chunks.len())
             .finish()
     }
 }
 
-impl Arena {
+impl<W: PtrWord> Arena<W> {
     pub fn new(
-        start: FheUint64,
-        end: FheUint64,
-        server_key: ServerKey,
+        start: u64,
+        end: u64,
+        context: KeyContext,
         enc_false: FheBool,
-        enc_zero_u64: FheUint64,
+        enc_zero_u64: W,
     ) -> Self {
-        set_server_key(server_key.clone());
-        Self {
-            start: start.clone(),
+        let cursor = {
+            let _guard = context.enter();
+            enc_zero_u64.scalar_add(start)
+        };
+        let mut arena = Self {
+            start,
             end,
-            cursor: start,
-            server_key,
+            cursor,
+            context,
             enc_false,
             enc_zero_u64,
-        }
+            chunks: Vec::new(),
+        };
+        arena.set_free_list_capacity(DEFAULT_ARENA_FREE_SLOTS);
+        arena
     }
 
-    pub fn allocate(&mut self, size: FheUint64) -> EncryptedOption<EncryptedPtr> {
-        set_server_key(self.server_key.clone());
+    /// serves a request from the first free slot whose chunk is at least `size` bytes, otherwise bumps the cursor and records the new chunk in the first untracked slot.
+    /// A reused chunk keeps its recorded size, so a smaller request wastes the tail; zero-size requests never reuse or record a chunk.
+    pub fn allocate(&mut self, size: W) -> EncryptedOption<EncryptedPtr<W>> {
+        let _guard = self.context.enter();
 
-        let new_cursor = &self.cursor + &size;
-        let has_space = new_cursor.le(&self.end);
+        let non_zero = !size.scalar_eq(0);
+        let (reused, hit) = self.take_free(&size, &non_zero);
+
+        let new_cursor = self.cursor.add(&size);
+        let has_space = new_cursor.scalar_le(self.end);
         let wrapped = new_cursor.lt(&self.cursor);
-        let ok = (&has_space) & (&wrapped.not());
+        let bumped = (&has_space) & (&wrapped.not()) & (&hit).not();
 
-        let ptr_val = ok.if_then_else(&self.cursor, &self.enc_zero_u64);
-        self.cursor = ok.if_then_else(&new_cursor, &self.cursor);
+        Self::record(
+            &mut self.chunks,
+            &self.context,
+            &self.cursor,
+            &size,
+            &(&bumped & &non_zero),
+        );
+        let bump_val = W::select(&bumped, &self.cursor, &self.enc_zero_u64);
+        self.cursor = W::select(&bumped, &new_cursor, &self.cursor);
 
         EncryptedOption {
-            value: EncryptedPtr::new(ptr_val),
-            is_some: ok,
+            value: EncryptedPtr::new(W::select(&hit, &reused, &bump_val)),
+            is_some: hit | bumped,
         }
     }
 
+    /// claims the first free slot that fits `size` and returns its start with the hit flag; every slot is compared regardless of the outcome.
+    fn take_free(&mut self, size: &W, non_zero: &FheBool) -> (W, FheBool) {
+        let context = &self.context;
+        let fits: Vec<FheBool> = self
+            .chunks
+            .par_iter()
+            .map(|chunk| {
+                context.install();
+                &chunk.free & size.le(&chunk.size) & non_zero
+            })
+            .collect();
+        let (first, any) = first_set(&fits, context);
+
+        let chunks = &self.chunks;
+        let reused = one_hot_select_by(&first, |i| &chunks[i].start, &self.enc_zero_u64, context);
+        self.chunks
+            .par_iter_mut()
+            .zip(first.par_iter())
+            .for_each(|(chunk, taken)| {
+                context.install();
+                chunk.free &= !taken;
+            });
+
+        (reused, any.unwrap_or_else(|| self.enc_false.clone()))
+    }
+
+    /// writes `(start, size)` into the first untracked slot under `condition`; a full free-list drops the record, leaving that chunk reclaimable only by `reset`.
+    /// Takes the slots rather than the arena so the cursor itself can be recorded without copying it.
+    fn record(
+        chunks: &mut [ArenaChunk<W>],
+        context: &KeyContext,
+        start: &W,
+        size: &W,
+        condition: &FheBool,
+    ) {
+        let untracked: Vec<FheBool> = chunks
+            .par_iter()
+            .map(|chunk| {
+                context.install();
+                !&chunk.tracked
+            })
+            .collect();
+        let (first, _) = first_set(&untracked, context);
+
+        chunks
+            .par_iter_mut()
+            .zip(first.par_iter())
+            .for_each(|(chunk, first)| {
+                context.install();
+                let write = first & condition;
+                chunk.start = W::select(&write, start, &chunk.start);
+                chunk.size = W::select(&write, size, &chunk.size);
+                chunk.tracked |= &write;
+            });
+    }
+
+    /// marks the tracked, live chunk starting at `ptr` free; foreign, double and untracked frees change nothing.
+    /// Every slot is compared once; a null pointer only matches when the arena itself starts at address zero.
+    pub fn free(&mut self, ptr: &EncryptedPtr<W>) {
+        self.free_batch(core::slice::from_ref(ptr));
+    }
+
+    /// releases a batch of pointers with one write per slot; each slot ORs its matches against every pointer.
+    pub fn free_batch(&mut self, ptrs: &[EncryptedPtr<W>]) {
+        let _guard = self.context.enter();
+        let context = &self.context;
+
+        self.chunks.par_iter_mut().for_each(|chunk| {
+            context.install();
+            let released = ptrs
+                .iter()
+                .map(|ptr| chunk.start.eq(&ptr.0))
+                .reduce(|acc, matched| acc | matched);
+            if let Some(released) = released {
+                chunk.free |= released & &chunk.tracked;
+            }
+        });
+    }
+
+    /// serves a whole batch: requests first claim free-list chunks in order, then the rest bump the cursor in order and are recorded, with the same results as consecutive `allocate` calls.
+    pub fn allocate_many(&mut self, sizes: &[W]) -> Vec<EncryptedOption<EncryptedPtr<W>>> {
+        let _guard = self.context.enter();
+
+        let mut reuses = Vec::with_capacity(sizes.len());
+        let mut bump_sizes = Vec::with_capacity(sizes.len());
+        for size in sizes {
+            let non_zero = !size.scalar_eq(0);
+            let (reused, hit) = self.take_free(size, &non_zero);
+            bump_sizes.push(W::select(&hit, &self.enc_zero_u64, size));
+            reuses.push((reused, hit, non_zero));
+        }
+
+        let bumps = self.bump_many(&bump_sizes);
+        bumps
+            .into_iter()
+            .zip(sizes)
+            .zip(reuses)
+            .map(|((bump, size), (reused, hit, non_zero))| {
+                let bumped = bump.is_some & (&hit).not();
+                Self::record(
+                    &mut self.chunks,
+                    &self.context,
+                    &bump.value.0,
+                    size,
+                    &(&bumped & &non_zero),
+                );
+                EncryptedOption {
+                    value: EncryptedPtr::new(W::select(&hit, &reused, &bump.value.0)),
+                    is_some: hit | bumped,
+                }
+            })
+            .collect()
+    }
+
+    /// bumps the cursor for each of `sizes` in order: every request checks its own fit against the cursor the successful requests before it left, so one that overflows `end` (or wraps) fails alone and later, smaller ones can still fit.
+    fn bump_many(&mut self, sizes: &[W]) -> Vec<EncryptedOption<EncryptedPtr<W>>> {
+        sizes
+            .iter()
+            .map(|size| {
+                let new_cursor = self.cursor.add(size);
+                let ok = new_cursor.scalar_le(self.end) & !new_cursor.lt(&self.cursor);
+                let start = W::select(&ok, &self.cursor, &self.enc_zero_u64);
+                self.cursor = W::select(&ok, &new_cursor, &self.cursor);
+                EncryptedOption {
+                    value: EncryptedPtr::new(start),
+                    is_some: ok,
+                }
+            })
+            .collect()
+    }
+
+    /// rewinds the cursor to `start` and forgets every free-list record; the add is a scalar one, so no key material beyond the server key is needed.
     pub fn reset(&mut self) {
-        set_server_key(self.server_key.clone());
-        self.cursor = self.start.clone();
+        let _guard = self.context.enter();
+        self.cursor = self.enc_zero_u64.scalar_add(self.start);
+        let capacity = self.chunks.len();
+        self.set_free_list_capacity(capacity);
+    }
+
+    /// writes the cursor followed by every free-list slot; the capacity itself belongs to the snapshot header.
+    pub(crate) fn write_snapshot(&self, out: &mut SnapshotWriter<impl Write>) -> io::Result<()> {
+        let words = [self.cursor.clone()].into_iter().chain(
+            self.chunks
+                .iter()
+                .flat_map(|chunk| [chunk.start.clone(), chunk.size.clone()]),
+        );
+        out.write_section(words)?;
+        out.write_section(
+            self.chunks
+                .iter()
+                .flat_map(|chunk| [chunk.tracked.clone(), chunk.free.clone()]),
+        )
     }
 
-    pub fn start(&self) -> &FheUint64 {
-        set_server_key(self.server_key.clone());
-        &self.start
+    /// restores what `write_snapshot` stored into an arena with `capacity` free-list slots.
+    pub(crate) fn read_snapshot(
+        &mut self,
+        input: &mut SnapshotReader<impl Read>,
+        capacity: usize,
+    ) -> io::Result<()> {
+        let words = capacity
+            .checked_mul(2)
+            .and_then(|bounds| bounds.checked_add(1))
+            .ok_or_else(|| invalid_data("snapshot free-list capacity overflows"))?;
+        let words = input.read_section::<W>(words)?;
+        let flags = input.read_section::<FheBool>(2 * capacity)?;
+        let (cursor, bounds) = words
+            .split_first()
+            .expect("read_section returns every requested entry");
+        self.cursor = cursor.clone();
+        self.chunks = bounds
+            .chunks_exact(2)
+            .zip(flags.chunks_exact(2))
+            .map(|(bounds, flags)| ArenaChunk {
+                start: bounds[0].clone(),
+                size: bounds[1].clone(),
+                tracked: flags[0].clone(),
+                free: flags[1].clone(),
+            })
+            .collect();
+        Ok(())
     }
 
-    pub fn end(&self) -> &FheUint64 {
-        set_server_key(self.server_key.clone());
-        &self.end
+    pub fn free_list_capacity(&self) -> usize {
+        self.chunks.len()
     }
 
-    pub fn cursor(&self) -> &FheUint64 {
-        set_server_key(self.server_key.clone());
+    /// resizes the free-list to `capacity` empty slots; chunks recorded so far are forgotten and stay allocated until `reset`.
+    /// Every allocate and free visits each slot, so the capacity trades reuse depth against per-call cost.
+    pub fn set_free_list_capacity(&mut self, capacity: usize) {
+        let empty = ArenaChunk {
+            start: self.enc_zero_u64.clone(),
+            size: self.enc_zero_u64.clone(),
+            tracked: self.enc_false.clone(),
+            free: self.enc_false.clone(),
+        };
+        self.chunks = vec![empty; capacity];
+    }
+
+    pub fn start(&self) -> u64 {
+        self.start
+    }
+
+    pub fn end(&self) -> u64 {
+        self.end
+    }
+
+    pub fn cursor(&self) -> &W {
         &self.cursor
     }
 
     pub fn enc_false(&self) -> &FheBool {
-        set_server_key(self.server_key.clone());
         &self.enc_false
     }
+
+    /// moves the cursor, the free-list slots and the constants onto the device of the installed key.
+    #[cfg(feature = "gpu")]
+    pub fn move_to_current_device(&mut self) {
+        let _guard = self.context.enter();
+        self.context.move_to_device(&mut self.chunks, |chunk| {
+            chunk.start.move_to_current_device();
+            chunk.size.move_to_current_device();
+            chunk.tracked.move_to_current_device();
+            chunk.free.move_to_current_device();
+        });
+        self.cursor.move_to_current_device();
+        self.enc_false.move_to_current_device();
+        self.enc_zero_u64.move_to_current_device();
+    }
 }
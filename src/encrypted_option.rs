@@ -1,16 +1,12 @@
 //! EncryptedOption is the struct-based option variant used for constant-time folding; `is_some` is an encrypted flag, `value` is the ciphertext payload.
 //! `combine_with` relies on `cond.if_then_else(&then, &else)` plus encrypted-or, so no plaintext control flow ever decides which branch wins.
 //! Callers feed it payloads that are cmux-able by value (FHE integers, booleans, EncryptedPtr) and let the selector move ciphertext handles without exposing them.
+//! Selection runs on whichever `KeyContext` the caller has entered; nothing here touches key material.
 
-use crate::{encrypted_ptr::EncryptedPtr, keys::clone_global_server_key};
+use crate::{encrypted_ptr::EncryptedPtr, keys::KeyContext};
 use core::fmt;
-use tfhe::{prelude::IfThenElse, set_server_key, FheBool, FheUint32, FheUint64};
-
-fn reseat_server_key() {
-    if let Some(server_key) = clone_global_server_key() {
-        set_server_key(server_key);
-    }
-}
+use rayon::prelude::*;
+use tfhe::{prelude::IfThenElse, FheBool, FheUint16, FheUint32, FheUint64};
 
 #[derive(Clone)]
 pub struct EncryptedOption<T: Clone> {
@@ -29,7 +25,6 @@ impl<T: Clone> fmt::Debug for EncryptedOption<T> {
 
 impl<T: Clone> EncryptedOption<T> {
     pub fn some(value: T, enc_true: FheBool) -> Self {
-        reseat_server_key();
         Self {
             value,
             is_some: enc_true,
@@ -37,7 +32,6 @@ impl<T: Clone> EncryptedOption<T> {
     }
 
     pub fn none(dummy_value: T, enc_false: FheBool) -> Self {
-        reseat_server_key();
         Self {
             value: dummy_value,
             is_some: enc_false,
@@ -50,14 +44,40 @@ where
     T: Clone + CipherSelectable,
 {
     pub fn combine_with(&self, other: &Self) -> Self {
-        reseat_server_key();
-        let combined_value = T::select(&other.is_some, &other.value, &self.value);
-        let combined_flag = self.is_some.clone() | other.is_some.clone();
         Self {
-            value: combined_value,
-            is_some: combined_flag,
+            value: T::select(&other.is_some, &other.value, &self.value),
+            is_some: &self.is_some | &other.is_some,
         }
     }
+
+    /// `combine_with` that folds `other` into `self`: the flag is OR-ed in place and only the payload mux produces a new ciphertext.
+    pub fn absorb(&mut self, other: &Self) {
+        self.value = T::select(&other.is_some, &other.value, &self.value);
+        self.is_some |= &other.is_some;
+    }
+}
+
+impl<T> EncryptedOption<T>
+where
+    T: Clone + CipherSelectable + Send + Sync,
+{
+    /// folds `options` pairwise level by level, keeping the precedence of a left-to-right `combine_with` chain (later `is_some` wins) at log2 depth; pairs of one level run on rayon.
+    /// An odd last option moves up a level unchanged instead of being copied.
+    pub fn combine_balanced(mut level: Vec<Self>, context: &KeyContext) -> Option<Self> {
+        while level.len() > 1 {
+            let carried = (level.len() % 2 == 1).then(|| level.pop()).flatten();
+            let mut next: Vec<Self> = level
+                .par_chunks(2)
+                .map(|pair| {
+                    context.install();
+                    pair[0].combine_with(&pair[1])
+                })
+                .collect();
+            next.extend(carried);
+            level = next;
+        }
+        level.pop()
+    }
 }
 
 pub trait CipherSelectable: Clone {
@@ -66,29 +86,31 @@ pub trait CipherSelectable: Clone {
 
 impl CipherSelectable for FheBool {
     fn select(cond: &FheBool, when_true: &Self, when_false: &Self) -> Self {
-        reseat_server_key();
+        cond.if_then_else(when_true, when_false)
+    }
+}
+
+impl CipherSelectable for FheUint16 {
+    fn select(cond: &FheBool, when_true: &Self, when_false: &Self) -> Self {
         cond.if_then_else(when_true, when_false)
     }
 }
 
 impl CipherSelectable for FheUint32 {
     fn select(cond: &FheBool, when_true: &Self, when_false: &Self) -> Self {
-        reseat_server_key();
         cond.if_then_else(when_true, when_false)
     }
 }
 
 impl CipherSelectable for FheUint64 {
     fn select(cond: &FheBool, when_true: &Self, when_false: &Self) -> Self {
-        reseat_server_key();
         cond.if_then_else(when_true, when_false)
     }
 }
 
-impl CipherSelectable for EncryptedPtr {
+impl<W: CipherSelectable> CipherSelectable for EncryptedPtr<W> {
     fn select(cond: &FheBool, when_true: &Self, when_false: &Self) -> Self {
-        reseat_server_key();
-        let chosen_offset = cond.if_then_else(&when_true.0, &when_false.0);
+        let chosen_offset = W::select(cond, &when_true.0, &when_false.0);
         EncryptedPtr::new(chosen_offset)
     }
 }
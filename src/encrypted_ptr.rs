@@ -1,22 +1,18 @@
-/// EncryptedPtr carries a single `FheUint64` byte offset; null is `EncryptedPtr(enc_zero_u64)` and no plaintext address math ever happens.
-/// Downstream slabs treat the wrapped ciphertext as the full pointer payload and reseat the global server key before constructing one.
-use crate::keys::clone_global_server_key;
+/// EncryptedPtr carries a single encrypted byte offset, `FheUint64` unless the allocator runs on a narrower `PtrWord`; null is the encrypted zero and no plaintext address math ever happens.
+/// Downstream slabs treat the wrapped ciphertext as the full pointer payload; wrapping is free and never needs a server key.
 use core::fmt;
-use tfhe::{set_server_key, FheUint64};
+use tfhe::FheUint64;
 
 #[derive(Clone)]
-pub struct EncryptedPtr(pub FheUint64);
+pub struct EncryptedPtr<W = FheUint64>(pub W);
 
-impl EncryptedPtr {
-    pub fn new(offset: FheUint64) -> Self {
-        if let Some(server_key) = clone_global_server_key() {
-            set_server_key(server_key);
-        }
+impl<W> EncryptedPtr<W> {
+    pub fn new(offset: W) -> Self {
         Self(offset)
     }
 }
 
-impl fmt::Debug for EncryptedPtr {
+impl<W> fmt::Debug for EncryptedPtr<W> {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         f.debug_tuple("EncryptedPtr")
             .field(&"<ciphertext>")
@@ -1,55 +1,131 @@
-// evm maintains encrypted pc/halt plus fully encrypted stack and memory, runs plaintext opcodes, and never owns a client key; pre-encrypted pc values are injected so execution avoids runtime encryption.
+// evm maintains encrypted pc/halt plus fully encrypted stack and memory, runs plaintext opcodes, and never owns a client key; the few encrypted constants it needs are injected so execution avoids runtime encryption.
+// the stack is a fixed `STACK_CAPACITY`-word `ScanMemory` allocated once; its capacity, slot indices and unit steps are public and are applied as scalar operands rather than trivially encrypted per call.
+// `step` fetches the opcode at the encrypted pc through a one-hot over the public program, evaluates every supported opcode's candidate effect on the rayon pool, and muxes the results by the opcode one-hot.
+// memory goes through an `ObliviousMemory` backend (`ScanMemory` by default), so loads and stores at encrypted addresses never reveal the word they touch.
+use crate::{
+    keys::KeyContext,
+    oblivious::{ObliviousMemory, ScanMemory},
+    scan::one_hot_select,
+};
 use core::fmt;
-use tfhe::{prelude::*, set_server_key, FheBool, FheUint32, FheUint64, ServerKey};
+use rayon::prelude::*;
+use tfhe::{prelude::*, FheBool, FheUint32, FheUint64};
 
-#[allow(dead_code)]
-pub struct EVM {
+/// words the EVM stack holds; pushes beyond it are dropped under the encrypted overflow guard.
+pub const STACK_CAPACITY: usize = 1024;
+
+/// the opcodes `step` executes, with their EVM byte values; memory is addressed by word rather than by byte, and jumps need no `JUMPDEST`.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(u8)]
+pub enum Opcode {
+    Stop = 0x00,
+    Add = 0x01,
+    Mul = 0x02,
+    Sub = 0x03,
+    Lt = 0x10,
+    Eq = 0x14,
+    Pop = 0x50,
+    Mload = 0x51,
+    Mstore = 0x52,
+    Jump = 0x56,
+    Jumpi = 0x57,
+    Push1 = 0x60,
+    Dup1 = 0x80,
+    Swap1 = 0x90,
+}
+
+impl Opcode {
+    pub const ALL: [Opcode; 14] = [
+        Opcode::Stop,
+        Opcode::Add,
+        Opcode::Mul,
+        Opcode::Sub,
+        Opcode::Lt,
+        Opcode::Eq,
+        Opcode::Pop,
+        Opcode::Mload,
+        Opcode::Mstore,
+        Opcode::Jump,
+        Opcode::Jumpi,
+        Opcode::Push1,
+        Opcode::Dup1,
+        Opcode::Swap1,
+    ];
+
+    /// `(pops, pushes)`: stack words the opcode needs on entry and leaves from that region on exit.
+    pub const fn stack_effect(self) -> (u32, u32) {
+        match self {
+            Opcode::Stop => (0, 0),
+            Opcode::Push1 => (0, 1),
+            Opcode::Add | Opcode::Mul | Opcode::Sub | Opcode::Lt | Opcode::Eq => (2, 1),
+            Opcode::Pop | Opcode::Jump => (1, 0),
+            Opcode::Mload => (1, 1),
+            Opcode::Mstore | Opcode::Jumpi => (2, 0),
+            Opcode::Dup1 => (1, 2),
+            Opcode::Swap1 => (2, 2),
+        }
+    }
+}
+
+pub struct EVM<M = ScanMemory> {
     pc: FheUint32,
-    stack: Vec<FheUint64>,
+    stack: ScanMemory,
     stack_len: FheUint32,
-    memory: Vec<FheUint64>,
+    memory: M,
     halt: FheBool,
     program: Vec<u8>,
-    server_key: ServerKey,
+    context: KeyContext,
     enc_false: FheBool,
-    enc_true: FheBool,
     enc_zero_u32: FheUint32,
     enc_zero_u64: FheUint64,
-    enc_one_u32: FheUint32,
-    enc_pc_values: Vec<FheUint32>,
 }
 
-impl fmt::Debug for EVM {
+impl<M: ObliviousMemory<FheUint64>> fmt::Debug for EVM<M> {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         f.debug_struct("EVM")
             .field("program_len", &self.program.len())
             .field("memory_len", &self.memory.len())
-            .field("stack_cap", &1024)
+            .field("stack_cap", &STACK_CAPACITY)
             .finish()
     }
 }
 
-#[allow(dead_code)]
 impl EVM {
-    #[allow(clippy::too_many_arguments)]
+    /// builds an EVM whose `memory_size` words live in a `ScanMemory`.
     pub fn new(
         program: Vec<u8>,
         memory_size: usize,
-        server_key: ServerKey,
+        context: KeyContext,
         enc_false: FheBool,
-        enc_true: FheBool,
         enc_zero_u32: FheUint32,
         enc_zero_u64: FheUint64,
-        enc_one_u32: FheUint32,
-        enc_pc_values: Vec<FheUint32>,
     ) -> Self {
-        set_server_key(server_key.clone());
+        let memory = ScanMemory::new(memory_size, enc_zero_u64.clone(), context.clone());
+        Self::with_memory(
+            program,
+            memory,
+            context,
+            enc_false,
+            enc_zero_u32,
+            enc_zero_u64,
+        )
+    }
+}
 
+impl<M: ObliviousMemory<FheUint64>> EVM<M> {
+    /// builds an EVM over any oblivious memory backend.
+    pub fn with_memory(
+        program: Vec<u8>,
+        memory: M,
+        context: KeyContext,
+        enc_false: FheBool,
+        enc_zero_u32: FheUint32,
+        enc_zero_u64: FheUint64,
+    ) -> Self {
         let pc = enc_zero_u32.clone();
         let halt = enc_false.clone();
         let stack_len = enc_zero_u32.clone();
-        let stack = Vec::with_capacity(1024);
-        let memory = vec![enc_zero_u64.clone(); memory_size];
+        let stack = ScanMemory::new(STACK_CAPACITY, enc_zero_u64.clone(), context.clone());
 
         Self {
             pc,
@@ -58,70 +134,259 @@ impl EVM {
             memory,
             halt,
             program,
-            server_key,
+            context,
             enc_false,
-            enc_true,
             enc_zero_u32,
             enc_zero_u64,
-            enc_one_u32,
-            enc_pc_values,
         }
     }
 
-    // stack helpers use encrypted guards for overflow/underflow, run fixed-length scans, and never branch on ciphertexts.
-    // encrypted push: always appends a ciphertext payload, guards logical growth with can_push, and bumps stack_len conditionally; physical growth is ignored by consumers beyond stack_len.
-    fn stack_push(&mut self, value: FheUint64, condition: FheBool) {
-        set_server_key(self.server_key.clone());
+    pub fn stack_len(&self) -> &FheUint32 {
+        &self.stack_len
+    }
 
-        let enc_cap =
-            FheUint32::try_encrypt_trivial(1024u32).unwrap_or_else(|_| self.enc_zero_u32.clone());
-        let has_space = self.stack_len.lt(&enc_cap);
-        let can_push = has_space & condition;
+    pub fn pc(&self) -> &FheUint32 {
+        &self.pc
+    }
 
-        let stored = can_push.if_then_else(&value, &self.enc_zero_u64);
-        self.stack.push(stored);
+    pub fn halted(&self) -> &FheBool {
+        &self.halt
+    }
 
-        let bumped = &self.stack_len + &self.enc_one_u32;
-        self.stack_len = can_push.if_then_else(&bumped, &self.stack_len);
+    pub fn memory(&self) -> &M {
+        &self.memory
     }
+}
 
-    // encrypted pop: scans the fixed logical depth, selects the top element under can_pop, and conditionally decrements stack_len.
-    fn stack_pop(&mut self, condition: FheBool) -> FheUint64 {
-        set_server_key(self.server_key.clone());
-
-        let has_item = self.stack_len.gt(&self.enc_zero_u32);
-        let can_pop = has_item & condition;
-        let target_index = &self.stack_len - &self.enc_one_u32;
-
-        let mut value = self.enc_zero_u64.clone();
-        for idx in 0..1024 {
-            let enc_idx =
-                FheUint32::try_encrypt_trivial(idx as u32).unwrap_or_else(|_| self.enc_zero_u32.clone());
-            let slot = self
-                .stack
-                .get(idx)
-                .cloned()
-                .unwrap_or_else(|| self.enc_zero_u64.clone());
-            let is_target = can_pop.clone() & enc_idx.eq(&target_index);
-            value = is_target.if_then_else(&slot, &value);
-        }
+impl<M: ObliviousMemory<FheUint64> + Send + Sync> EVM<M> {
+    /// executes one instruction in constant time: every supported opcode's effect is computed and the opcode one-hot picks which writes land.
+    /// An unknown opcode, a pc past the program, a stack underflow or overflow, a jump taken to a target outside the program, and `STOP` all set `halt`; once halted, steps change nothing.
+    /// Memory operands of `2^32` and above address no word: `MLOAD` reads zero and `MSTORE` writes nothing.
+    pub fn step(&mut self) {
+        let _guard = self.context.enter();
+        let context = &self.context;
+
+        let at_pc: Vec<FheBool> = (0..self.program.len())
+            .into_par_iter()
+            .map(|i| {
+                context.install();
+                self.pc.eq(i as u32)
+            })
+            .collect();
+        let len = &self.stack_len;
+        let active = !&self.halt;
+        let has = [
+            active.clone(),
+            len.ge(1u32) & &active,
+            len.ge(2u32) & &active,
+        ];
+        let has_space = len.lt(STACK_CAPACITY as u32);
+
+        let first_index = len - 1u32;
+        let second_index = len - 2u32;
+        let (a, b) = rayon::join(
+            || {
+                context.install();
+                self.stack.read(&first_index, &has[1])
+            },
+            || {
+                context.install();
+                self.stack.read(&second_index, &has[2])
+            },
+        );
+        // the 32-bit cell index and pc take the operand's low bits, so each use is also gated on the full operand being in range.
+        let address = FheUint32::cast_from(a.clone());
+        let (addressable, (in_program, taken)) = rayon::join(
+            || {
+                context.install();
+                a.lt(1u64 << 32)
+            },
+            || {
+                context.install();
+                rayon::join(
+                    || {
+                        context.install();
+                        a.lt(self.program.len() as u64)
+                    },
+                    || {
+                        context.install();
+                        b.ne(0u64)
+                    },
+                )
+            },
+        );
+
+        // opcode one-hot, already gated by the halt flag, by the opcode's stack guard and, for a jump that would leave the program, by its target.
+        let sel: Vec<FheBool> = Opcode::ALL
+            .par_iter()
+            .map(|&op| {
+                context.install();
+                let (pops, pushes) = op.stack_effect();
+                let guard = match pushes > pops {
+                    true => &has[pops as usize] & &has_space,
+                    false => has[pops as usize].clone(),
+                };
+                let guard = match op {
+                    Opcode::Jump => guard & &in_program,
+                    Opcode::Jumpi => guard & !(&taken & !&in_program),
+                    _ => guard,
+                };
+                self.fetch_flag(&at_pc, |byte, _| byte == op as u8) & guard
+            })
+            .collect();
+        let [_, add, mul, sub, lt, eq, _, mload, mstore, jump, jumpi, push1, dup1, swap1]: [FheBool;
+            14] = sel.clone().try_into().unwrap_or_else(|_| unreachable!());
+        let (mload_in_range, mstore_in_range) = (&mload & &addressable, &mstore & &addressable);
+
+        let (alu, (loaded, immediate)) = rayon::join(
+            || self.alu(&a, &b),
+            || {
+                rayon::join(
+                    || {
+                        context.install();
+                        self.memory.read(&address, &mload_in_range)
+                    },
+                    || self.immediate(&at_pc),
+                )
+            },
+        );
+
+        // every opcode writes at most one word per slot: the binary results and SWAP1's old top land below the top, MLOAD and SWAP1 rewrite the top, PUSH1 and DUP1 fill the slot above it.
+        let writes = [
+            (
+                &second_index,
+                vec![add, mul, sub, lt, eq, swap1.clone()],
+                [alu.to_vec(), vec![a.clone()]].concat(),
+            ),
+            (&first_index, vec![mload, swap1], vec![loaded, b.clone()]),
+            (len, vec![push1.clone(), dup1], vec![immediate, a.clone()]),
+        ];
+        let stack = &mut self.stack;
+        let memory = &mut self.memory;
+        let zero = &self.enc_zero_u64;
+        rayon::join(
+            || {
+                context.install();
+                for (index, selectors, values) in &writes {
+                    let value = one_hot_select(selectors, values, zero, context);
+                    let condition = any(selectors, context);
+                    stack.write(index, &value, &condition);
+                }
+            },
+            || {
+                context.install();
+                memory.write(&address, &b, &mstore_in_range);
+            },
+        );
 
-        let decremented = &self.stack_len - &self.enc_one_u32;
-        self.stack_len = can_pop.if_then_else(&decremented, &self.stack_len);
-        value
+        let proceed = any(&sel[1..], context);
+        let halts = !&proceed;
+        let jumped = &jump | (&jumpi & &taken);
+        let advances = &proceed & !(&jumped | &push1);
+        self.pc = one_hot_select(
+            &[advances, push1, jumped, halts.clone()],
+            &[&self.pc + 1u32, &self.pc + 2u32, address, self.pc.clone()],
+            &self.enc_zero_u32,
+            context,
+        );
+
+        let by_delta = |delta: i64| {
+            let flags: Vec<FheBool> = Opcode::ALL
+                .iter()
+                .zip(&sel)
+                .filter(|(op, _)| {
+                    let (pops, pushes) = op.stack_effect();
+                    i64::from(pushes) - i64::from(pops) == delta
+                })
+                .map(|(_, flag)| flag.clone())
+                .collect();
+            any(&flags, context)
+        };
+        let (shrinks_two, shrinks_one, grows) = (by_delta(-2), by_delta(-1), by_delta(1));
+        let keeps = !(&shrinks_two | &shrinks_one | &grows);
+        self.stack_len = one_hot_select(
+            &[shrinks_two, shrinks_one, grows, keeps],
+            &[second_index, first_index, len + 1u32, len.clone()],
+            &self.enc_zero_u32,
+            context,
+        );
+
+        self.halt = halts;
     }
 
-    // encrypted double-pop: requires two items, returns (second, first) with underflow masked to zeros.
-    fn stack_pop2(&mut self, condition: FheBool) -> (FheUint64, FheUint64) {
-        set_server_key(self.server_key.clone());
+    /// runs a fixed budget of `max_steps` steps; the count is public, and steps after a halt are no-ops, so the run time never depends on the program's path.
+    pub fn run(&mut self, max_steps: usize) {
+        for _ in 0..max_steps {
+            self.step();
+        }
+    }
 
-        let enc_two =
-            FheUint32::try_encrypt_trivial(2u32).unwrap_or_else(|_| self.enc_zero_u32.clone());
-        let has_two = self.stack_len.ge(&enc_two);
-        let can_pop = has_two & condition;
+    /// ORs the pc one-hot over the program positions whose byte (and following byte, zero past the end) satisfy `matches`.
+    fn fetch_flag(&self, at_pc: &[FheBool], matches: impl Fn(u8, u8) -> bool + Sync) -> FheBool {
+        let context = &self.context;
+        (0..self.program.len())
+            .into_par_iter()
+            .filter(|&i| {
+                matches(
+                    self.program[i],
+                    self.program.get(i + 1).copied().unwrap_or(0),
+                )
+            })
+            .map(|i| at_pc[i].clone())
+            .reduce_with(|left, right| {
+                context.install();
+                left | right
+            })
+            .unwrap_or_else(|| self.enc_false.clone())
+    }
 
-        let first = self.stack_pop(can_pop.clone());
-        let second = self.stack_pop(can_pop);
-        (second, first)
+    /// the `PUSH1` immediate at the pc, assembled bit by bit from the public program bytes.
+    fn immediate(&self, at_pc: &[FheBool]) -> FheUint64 {
+        let context = &self.context;
+        (0..u8::BITS)
+            .into_par_iter()
+            .map(|bit| {
+                context.install();
+                let set = self.fetch_flag(at_pc, |byte, next| {
+                    byte == Opcode::Push1 as u8 && (next >> bit) & 1 == 1
+                });
+                FheUint64::cast_from(set) << bit
+            })
+            .reduce_with(|left, right| {
+                context.install();
+                left | right
+            })
+            .unwrap_or_else(|| self.enc_zero_u64.clone())
     }
+
+    /// candidate results of the binary opcodes in `Opcode::ALL` order (`ADD`, `MUL`, `SUB`, `LT`, `EQ`), each evaluated on its own worker; `a` is the top of the stack.
+    fn alu(&self, a: &FheUint64, b: &FheUint64) -> [FheUint64; 5] {
+        let context = &self.context;
+        let results: Vec<FheUint64> = Opcode::ALL[1..6]
+            .par_iter()
+            .map(|op| {
+                context.install();
+                match op {
+                    Opcode::Add => a + b,
+                    Opcode::Mul => a * b,
+                    Opcode::Sub => a - b,
+                    Opcode::Lt => FheUint64::cast_from(a.lt(b)),
+                    _ => FheUint64::cast_from(a.eq(b)),
+                }
+            })
+            .collect();
+        results.try_into().unwrap_or_else(|_| unreachable!())
+    }
+}
+
+/// OR of every flag in `flags`, reduced as a balanced tree.
+fn any(flags: &[FheBool], context: &KeyContext) -> FheBool {
+    flags
+        .par_iter()
+        .cloned()
+        .reduce_with(|left, right| {
+            context.install();
+            left | right
+        })
+        .expect("at least one flag")
 }
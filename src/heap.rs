@@ -0,0 +1,183 @@
+//! heap is the data plane behind a `CryptMalloc`'s address space: one encrypted word per `T::BITS / 8` bytes of the allocator's `heap_range`, so every pointer the allocator hands out addresses it directly.
+//! Each access decodes its pointer once into a word index over a `ScanMemory` grid; `memcpy` and `memset` decode each pointer once per call and reach the following words by shifting the one-hot selectors a public distance, so only the muxes grow with the length.
+//! Public: the heap range, the word width and every length given as a `usize`. Encrypted: pointers, contents, conditions and `zero`'s byte count; a pointer outside the range or off a word boundary reads zero and writes nothing.
+
+use crate::{
+    allocator::CryptMalloc,
+    encrypted_ptr::EncryptedPtr,
+    keys::{KeyContext, Keys},
+    oblivious::{ObliviousMemory, ScanMemory},
+    word::PtrWord,
+};
+use core::{fmt, marker::PhantomData};
+use rayon::prelude::*;
+use std::ops::Range;
+use tfhe::{FheBool, FheUint32, FheUint64};
+
+/// encrypted contents addressed by `W` pointers in words of type `T`; the defaults match `CryptMalloc` and hold eight bytes per word.
+pub struct Heap<W = FheUint64, T = FheUint64> {
+    base: u64,
+    memory: ScanMemory<T>,
+    context: KeyContext,
+    _pointer: PhantomData<W>,
+}
+
+impl<W, T> fmt::Debug for Heap<W, T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("Heap")
+            .field("base", &self.base)
+            .field("memory", &self.memory)
+            .finish()
+    }
+}
+
+impl<W: PtrWord, T: PtrWord> Heap<W, T> {
+    /// zeroed words covering `allocator.heap_range()`, encrypted under the allocator's keys.
+    pub fn for_allocator<const N: usize>(allocator: &CryptMalloc<N, W>) -> Self {
+        Self::new(allocator.heap_range(), allocator.keys())
+    }
+
+    /// zeroed words covering `range`, whose start must sit on a word boundary; a partial last word is rounded up.
+    pub fn new(range: Range<u64>, keys: &Keys) -> Self {
+        let word_bytes = Self::word_bytes();
+        assert!(
+            range.start.is_multiple_of(word_bytes),
+            "a heap must start on a {word_bytes}-byte word boundary"
+        );
+        let words = range.end.saturating_sub(range.start).div_ceil(word_bytes);
+        assert!(
+            words <= u64::from(u32::MAX),
+            "{words} words do not fit a 32-bit cell index"
+        );
+
+        let context = keys.context().clone();
+        let _guard = context.enter();
+        Self {
+            base: range.start,
+            memory: ScanMemory::new(words as usize, keys.enc_word(0), context.clone()),
+            context,
+            _pointer: PhantomData,
+        }
+    }
+
+    /// bytes per word.
+    pub fn word_bytes() -> u64 {
+        u64::from(T::BITS / 8)
+    }
+
+    /// the public address range the words cover.
+    pub fn range(&self) -> Range<u64> {
+        self.base..self.base + self.memory.len() as u64 * Self::word_bytes()
+    }
+
+    pub fn memory(&self) -> &ScanMemory<T> {
+        &self.memory
+    }
+
+    /// the word at `ptr`, zero for an invalid pointer.
+    pub fn load(&self, ptr: &EncryptedPtr<W>) -> T {
+        let _guard = self.context.enter();
+        let (index, valid) = self.locate(ptr);
+        self.memory.read(&index, &valid)
+    }
+
+    /// overwrites the word at `ptr` with `value` when `condition` holds.
+    pub fn store(&mut self, ptr: &EncryptedPtr<W>, value: &T, condition: &FheBool) {
+        let _guard = self.context.enter();
+        let (index, valid) = self.locate(ptr);
+        self.memory.write(&index, value, &(valid & condition));
+    }
+
+    /// one `load` per pointer, decoded and read in parallel.
+    pub fn load_many(&self, ptrs: &[EncryptedPtr<W>]) -> Vec<T> {
+        let _guard = self.context.enter();
+        let accesses = self.locate_many(ptrs, None);
+        self.memory.read_many(&accesses)
+    }
+
+    /// stores `values[k]` at `ptrs[k]` in order when `condition` holds, touching every word once; a later store to the same word wins.
+    pub fn store_many(&mut self, ptrs: &[EncryptedPtr<W>], values: &[T], condition: &FheBool) {
+        assert_eq!(ptrs.len(), values.len(), "one value per pointer");
+        let _guard = self.context.enter();
+        let accesses = self.locate_many(ptrs, Some(condition));
+        self.memory.write_many(&accesses, values);
+    }
+
+    /// copies `words` words from `src` to `dst` when `condition` and both pointers are valid; the source is read in full before the first write, so overlapping runs behave like `memmove`.
+    /// Each pointer is decoded once whatever `words` is; words past the heap end read zero and are not written.
+    pub fn memcpy(
+        &mut self,
+        dst: &EncryptedPtr<W>,
+        src: &EncryptedPtr<W>,
+        words: usize,
+        condition: &FheBool,
+    ) {
+        let _guard = self.context.enter();
+        let ((dst_index, dst_valid), (src_index, src_valid)) = rayon::join(
+            || {
+                self.context.install();
+                self.locate(dst)
+            },
+            || {
+                self.context.install();
+                self.locate(src)
+            },
+        );
+        let values = self.memory.read_run(&src_index, words, &src_valid);
+        let write = dst_valid & src_valid & condition;
+        self.memory.write_run(&dst_index, &values, &write);
+    }
+
+    /// sets `words` words from `dst` on to `value` when `condition` and the pointer are valid, decoding `dst` once.
+    pub fn memset(&mut self, dst: &EncryptedPtr<W>, value: &T, words: usize, condition: &FheBool) {
+        let _guard = self.context.enter();
+        let (index, valid) = self.locate(dst);
+        self.memory
+            .fill_run(&index, words, value, &(valid & condition));
+    }
+
+    /// clears every word whose first byte lies in `ptr .. ptr + bytes` when `condition` holds, e.g. the block `CryptMalloc::calloc` returned, with its `is_some` as the condition.
+    /// The length stays encrypted, so each word runs two comparisons against its public address instead of a one-hot decode.
+    pub fn zero(&mut self, ptr: &EncryptedPtr<W>, bytes: &W, condition: &FheBool) {
+        let _guard = self.context.enter();
+        let context = &self.context;
+        let end = ptr.0.add(bytes);
+        let word_bytes = Self::word_bytes();
+        let mask: Vec<FheBool> = (0..self.memory.len())
+            .into_par_iter()
+            .map(|i| {
+                context.install();
+                let address = self.base + i as u64 * word_bytes;
+                ptr.0.scalar_le(address) & !end.scalar_le(address) & condition
+            })
+            .collect();
+        self.memory.overwrite(&mask, &T::trivial_word(0));
+    }
+
+    /// the word index of `ptr` plus an encrypted flag that holds only for in-range, word-aligned pointers; the index is meaningless when the flag is false.
+    fn locate(&self, ptr: &EncryptedPtr<W>) -> (FheUint32, FheBool) {
+        let word_bytes = Self::word_bytes();
+        let offset = ptr.0.scalar_sub(self.base);
+        let in_range = offset.scalar_lt(self.memory.len() as u64 * word_bytes);
+        let aligned = offset.scalar_bitand(word_bytes - 1).scalar_eq(0);
+        let index = offset.scalar_shr(word_bytes.trailing_zeros()).to_u32();
+        (index, in_range & aligned)
+    }
+
+    fn locate_many(
+        &self,
+        ptrs: &[EncryptedPtr<W>],
+        condition: Option<&FheBool>,
+    ) -> Vec<(FheUint32, FheBool)> {
+        ptrs.par_iter()
+            .map(|ptr| {
+                self.context.install();
+                let (index, valid) = self.locate(ptr);
+                match condition {
+                    Some(condition) => (index, valid & condition),
+                    None => (index, valid),
+                }
+            })
+            .collect()
+    }
+}
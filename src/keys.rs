@@ -1,18 +1,234 @@
-//! Keys owns the client key, exposes encrypted constants, and reseats tfhe's global server key before every ciphertext operation so downstream modules never touch plaintext secrets.
+//! Keys owns the client key, exposes encrypted constants, and hands out the shared `KeyContext` so downstream modules never touch plaintext secrets.
+//! Keys either come from fresh generation or from a serialized client key plus compressed server key (`save`/`load`), so restarts can skip keygen entirely.
+//! `KeyContext` is an `Arc`-backed server key handle; each thread installs it into tfhe at most once and `KeyGuard` scopes it per allocator call, so no key is cloned or locked on the hot path.
+//! With the `gpu` feature a context can also carry a `CudaServerKey`; installing it routes every ciphertext operation on that thread to the device instead of the CPU key.
 
-use core::fmt;
-use once_cell::sync::Lazy;
-use std::sync::RwLock;
+use crate::word::PtrWord;
+use core::{fmt, marker::PhantomData};
+use rayon::prelude::*;
+use std::{
+    cell::RefCell,
+    fs::{self, File},
+    io::{self, BufReader, BufWriter, Read, Write},
+    ops::Range,
+    path::Path,
+    process,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+};
+#[cfg(feature = "gpu")]
+use tfhe::CudaServerKey;
 use tfhe::{
-    generate_keys, prelude::FheEncrypt, set_server_key, ClientKey, ConfigBuilder, FheBool,
-    FheUint32, FheUint64, ServerKey,
+    prelude::FheEncrypt,
+    safe_serialization::{safe_deserialize, safe_serialize},
+    set_server_key,
+    shortint::parameters::{
+        COMP_PARAM_GPU_MULTI_BIT_GROUP_4_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128,
+        COMP_PARAM_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128,
+        PARAM_GPU_MULTI_BIT_GROUP_4_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128,
+        PARAM_MESSAGE_1_CARRY_1_KS_PBS_TUNIFORM_2M128,
+        PARAM_MULTI_BIT_GROUP_4_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128,
+    },
+    ClientKey, CompressedServerKey, Config, ConfigBuilder, FheBool, FheUint32, FheUint64,
+    ServerKey,
 };
 
-static GLOBAL_SERVER_KEY: Lazy<RwLock<Option<ServerKey>>> = Lazy::new(|| RwLock::new(None));
+/// numbers the staging files `load_or_generate` writes, so concurrent generators in one process never share one.
+static STAGING_FILES: AtomicU64 = AtomicU64::new(0);
+
+/// byte limit passed to tfhe's safe (de)serialization for each key; generous for default parameters while still rejecting corrupt length prefixes.
+pub const KEY_SERIALIZATION_LIMIT: u64 = 1 << 33;
+
+/// how the per-tier offset tables are produced; the entries are public layout values (`i * block_size`), so this choice only affects cost.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum TableConstruction {
+    /// fresh client-key encryptions, generated in parallel; indistinguishable from any other ciphertext.
+    #[default]
+    Encrypted,
+    /// trivial ciphertexts: no encryption work at all, but the entries remain readable without a key, which is fine whenever the tier layout is public anyway.
+    Trivial,
+}
+
+/// named tfhe parameter sets to generate keys under; every profile is a tfhe-vetted set at 128-bit security with a 2^-128 bootstrap failure probability (TUniform noise), so profiles differ only in how the work is shaped.
+/// `cargo bench --bench allocator -- profile` times allocate and free under each one; the profile is fixed at key generation and travels with saved keys.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum ParameterProfile {
+    /// tfhe's default classic 2_2 KS-PBS set: the least total work per bootstrap, best when the rayon scans keep every core busy.
+    #[default]
+    Throughput,
+    /// multi-bit PBS over groups of 4 key bits: each bootstrap spreads over several threads, trading some total work for lower latency on narrow, sequential chains.
+    Latency,
+    /// the multi-bit group-4 set tuned for the CUDA backend; pair it with `Keys::with_profile_on_gpu`.
+    Gpu,
+    /// 1-bit message, 1-bit carry blocks: a much smaller server key and cheaper bootstraps, but twice the blocks per integer; tfhe ships no compression set for it, so `CryptMalloc::snapshot` fails under this profile.
+    SmallKey,
+}
+
+impl ParameterProfile {
+    pub const ALL: [Self; 4] = [Self::Throughput, Self::Latency, Self::Gpu, Self::SmallKey];
+
+    /// the tfhe configuration, with the compression key `CryptMalloc::snapshot` needs wherever tfhe provides one.
+    pub fn config(self) -> Config {
+        match self {
+            Self::Throughput => ConfigBuilder::default()
+                .enable_compression(COMP_PARAM_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128)
+                .build(),
+            Self::Latency => ConfigBuilder::with_custom_parameters(
+                PARAM_MULTI_BIT_GROUP_4_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128,
+            )
+            .enable_compression(COMP_PARAM_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128)
+            .build(),
+            Self::Gpu => ConfigBuilder::with_custom_parameters(
+                PARAM_GPU_MULTI_BIT_GROUP_4_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128,
+            )
+            .enable_compression(
+                COMP_PARAM_GPU_MULTI_BIT_GROUP_4_MESSAGE_2_CARRY_2_KS_PBS_TUNIFORM_2M128,
+            )
+            .build(),
+            Self::SmallKey => {
+                ConfigBuilder::with_custom_parameters(PARAM_MESSAGE_1_CARRY_1_KS_PBS_TUNIFORM_2M128)
+                    .build()
+            }
+        }
+    }
+
+    /// false for profiles without a compression key, whose allocators cannot be snapshotted.
+    pub fn supports_snapshots(self) -> bool {
+        self != Self::SmallKey
+    }
+}
+
+thread_local! {
+    static INSTALLED_CONTEXT: RefCell<Option<KeyContext>> = const { RefCell::new(None) };
+}
+
+/// Shared server key handle; clones bump one refcount and every clone refers to the same key material.
+#[derive(Clone)]
+pub struct KeyContext {
+    server_key: Arc<ServerKey>,
+    #[cfg(feature = "gpu")]
+    cuda_key: Option<Arc<CudaServerKey>>,
+}
+
+impl fmt::Debug for KeyContext {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("KeyContext")
+            .field("server_key", &"<elided>")
+            .field("on_gpu", &self.on_gpu())
+            .finish()
+    }
+}
+
+impl KeyContext {
+    pub fn new(server_key: ServerKey) -> Self {
+        Self {
+            server_key: Arc::new(server_key),
+            #[cfg(feature = "gpu")]
+            cuda_key: None,
+        }
+    }
+
+    /// a context that evaluates on the GPU; the CPU key stays available through `server_key` for callers that need it.
+    #[cfg(feature = "gpu")]
+    pub fn with_cuda_key(server_key: ServerKey, cuda_key: CudaServerKey) -> Self {
+        Self {
+            server_key: Arc::new(server_key),
+            cuda_key: Some(Arc::new(cuda_key)),
+        }
+    }
+
+    /// true when `install` hands tfhe a CUDA server key; always false without the `gpu` feature.
+    pub fn on_gpu(&self) -> bool {
+        #[cfg(feature = "gpu")]
+        return self.cuda_key.is_some();
+        #[cfg(not(feature = "gpu"))]
+        false
+    }
+
+    pub fn server_key(&self) -> &ServerKey {
+        &self.server_key
+    }
+
+    /// true when this context is the one tfhe currently uses on the calling thread.
+    pub fn is_installed(&self) -> bool {
+        INSTALLED_CONTEXT.with(|slot| {
+            slot.borrow()
+                .as_ref()
+                .is_some_and(|current| Arc::ptr_eq(&current.server_key, &self.server_key))
+        })
+    }
+
+    /// installs the key into tfhe's thread-local slot unless this thread already runs on it; repeated calls only compare pointers.
+    /// Calling `tfhe::set_server_key` directly bypasses this bookkeeping, so mixed setups should go through a context.
+    pub fn install(&self) {
+        if self.is_installed() {
+            return;
+        }
+        #[cfg(feature = "gpu")]
+        if let Some(cuda_key) = &self.cuda_key {
+            set_server_key(CudaServerKey::clone(cuda_key));
+            INSTALLED_CONTEXT.with(|slot| *slot.borrow_mut() = Some(self.clone()));
+            return;
+        }
+        set_server_key(ServerKey::clone(&self.server_key));
+        INSTALLED_CONTEXT.with(|slot| *slot.borrow_mut() = Some(self.clone()));
+    }
+
+    /// applies tfhe's `move_to_current_device` (passed as `move_one`) to every ciphertext in `values` on the rayon pool, each worker on this context's key.
+    #[cfg(feature = "gpu")]
+    pub(crate) fn move_to_device<T: Send>(
+        &self,
+        values: &mut [T],
+        move_one: impl Fn(&mut T) + Sync,
+    ) {
+        values.par_iter_mut().for_each(|value| {
+            self.install();
+            move_one(value);
+        });
+    }
+
+    /// installs the key for the lifetime of the returned guard and reinstates whichever context the thread used before.
+    pub fn enter(&self) -> KeyGuard {
+        let previous = INSTALLED_CONTEXT.with(|slot| slot.borrow().clone());
+        self.install();
+        KeyGuard {
+            previous,
+            _thread_bound: PhantomData,
+        }
+    }
+}
+
+/// Scoped installation returned by `KeyContext::enter`; it is tied to the thread whose tfhe slot it changed.
+#[must_use = "the context is only scoped while the guard is alive"]
+pub struct KeyGuard {
+    previous: Option<KeyContext>,
+    _thread_bound: PhantomData<*const ()>,
+}
+
+impl fmt::Debug for KeyGuard {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("KeyGuard")
+            .field("restores_previous", &self.previous.is_some())
+            .finish()
+    }
+}
+
+impl Drop for KeyGuard {
+    fn drop(&mut self) {
+        if let Some(previous) = self.previous.take() {
+            previous.install();
+        }
+    }
+}
 
+/// Clones copy the client key and share the server key of one `KeyContext`, and the compressed server key it was expanded from.
+#[derive(Clone)]
 pub struct Keys {
     client_key: ClientKey,
-    server_key: ServerKey,
+    context: KeyContext,
+    compressed_server_key: Option<Arc<CompressedServerKey>>,
 }
 
 impl fmt::Debug for Keys {
@@ -26,68 +242,210 @@ impl fmt::Debug for Keys {
 
 impl Keys {
     pub fn new() -> Self {
-        let config = ConfigBuilder::default().build();
-        let (client_key, server_key) = generate_keys(config);
-        set_server_key(server_key.clone());
-        install_global_server_key(&server_key);
+        Self::with_profile(ParameterProfile::default())
+    }
+
+    /// fresh keys under a named parameter profile; generation goes through the compressed server key, which `save` later writes as is.
+    pub fn with_profile(profile: ParameterProfile) -> Self {
+        let client_key = ClientKey::generate(profile.config());
+        let server_key = CompressedServerKey::new(&client_key);
+        Self::expand(client_key, server_key)
+    }
+
+    /// wraps existing key material, e.g. keys shipped by a provisioning service, and installs the server key on the calling thread.
+    /// No compressed form comes with it, so `save` has to derive one.
+    pub fn from_keys(client_key: ClientKey, server_key: ServerKey) -> Self {
+        Self::with_context(client_key, KeyContext::new(server_key), None)
+    }
+
+    /// expands a compressed server key; tfhe decompresses the key material in parallel on the rayon pool.
+    pub fn from_compressed(client_key: ClientKey, server_key: &CompressedServerKey) -> Self {
+        Self::expand(client_key, server_key.clone())
+    }
+
+    /// expands a compressed server key both for the CPU and onto the current CUDA device; every context handed out evaluates on the GPU.
+    #[cfg(feature = "gpu")]
+    pub fn from_compressed_on_gpu(client_key: ClientKey, server_key: &CompressedServerKey) -> Self {
+        Self::expand_on_gpu(client_key, server_key.clone())
+    }
+
+    /// fresh keys under `ParameterProfile::Gpu` whose context evaluates on the GPU.
+    #[cfg(feature = "gpu")]
+    pub fn new_on_gpu() -> Self {
+        Self::with_profile_on_gpu(ParameterProfile::Gpu)
+    }
+
+    /// `with_profile`, with the server key expanded onto the GPU as well.
+    #[cfg(feature = "gpu")]
+    pub fn with_profile_on_gpu(profile: ParameterProfile) -> Self {
+        let client_key = ClientKey::generate(profile.config());
+        let server_key = CompressedServerKey::new(&client_key);
+        Self::expand_on_gpu(client_key, server_key)
+    }
+
+    /// `load`, but with the server key expanded onto the GPU as well.
+    #[cfg(feature = "gpu")]
+    pub fn load_on_gpu(reader: impl Read) -> io::Result<Self> {
+        let (client_key, server_key) = read_keys(reader)?;
+        Ok(Self::expand_on_gpu(client_key, server_key))
+    }
+
+    /// writes the client key followed by the compressed server key these keys were generated or loaded with, so the file holds exactly the key the allocator evaluates on.
+    /// Keys built with `from_keys` carry no compressed form; for them every call derives a fresh one from the client key, which costs a full server keygen.
+    pub fn save(&self, writer: impl Write) -> io::Result<()> {
+        match &self.compressed_server_key {
+            Some(server_key) => write_keys(&self.client_key, server_key, writer),
+            None => write_keys(
+                &self.client_key,
+                &CompressedServerKey::new(&self.client_key),
+                writer,
+            ),
+        }
+    }
+
+    /// reads what `save` wrote and decompresses the server key; accepts any reader, including a `&[u8]` over a memory-mapped file.
+    pub fn load(reader: impl Read) -> io::Result<Self> {
+        let (client_key, server_key) = read_keys(reader)?;
+        Ok(Self::expand(client_key, server_key))
+    }
+
+    /// loads keys from `path`, or generates them once and persists them there; the file is written beside the target under a name of its own and hard-linked into place, so concurrent starters never read a partial key file.
+    /// When two starters race, the first link wins and the other drops its fresh keys and loads the winner's, so every starter runs on the keys on disk.
+    /// Generation goes straight to the compressed server key, so the first start costs one keygen and every later start only a load plus decompression.
+    pub fn load_or_generate(path: impl AsRef<Path>) -> io::Result<Self> {
+        Self::load_or_generate_with_profile(path, ParameterProfile::default())
+    }
+
+    /// `load_or_generate` that generates under `profile`; an existing key file keeps whatever profile it was generated with.
+    pub fn load_or_generate_with_profile(
+        path: impl AsRef<Path>,
+        profile: ParameterProfile,
+    ) -> io::Result<Self> {
+        let path = path.as_ref();
+        if path.exists() {
+            return Self::load(BufReader::new(File::open(path)?));
+        }
+
+        let client_key = ClientKey::generate(profile.config());
+        let server_key = CompressedServerKey::new(&client_key);
+
+        let staging = path.with_extension(format!(
+            "tmp.{}.{}",
+            process::id(),
+            STAGING_FILES.fetch_add(1, Ordering::Relaxed)
+        ));
+        let written = File::options()
+            .write(true)
+            .create_new(true)
+            .open(&staging)
+            .and_then(|file| write_keys(&client_key, &server_key, BufWriter::new(file)))
+            .and_then(|()| fs::hard_link(&staging, path));
+        let _ = fs::remove_file(&staging);
+        match written {
+            Ok(()) => Ok(Self::expand(client_key, server_key)),
+            Err(err) if err.kind() == io::ErrorKind::AlreadyExists => {
+                Self::load(BufReader::new(File::open(path)?))
+            }
+            Err(err) => Err(err),
+        }
+    }
+
+    /// decompresses `server_key` into a fresh context and keeps the compressed form for `save`.
+    fn expand(client_key: ClientKey, server_key: CompressedServerKey) -> Self {
+        let context = KeyContext::new(server_key.decompress());
+        Self::with_context(client_key, context, Some(server_key))
+    }
+
+    #[cfg(feature = "gpu")]
+    fn expand_on_gpu(client_key: ClientKey, server_key: CompressedServerKey) -> Self {
+        let context =
+            KeyContext::with_cuda_key(server_key.decompress(), server_key.decompress_to_gpu());
+        Self::with_context(client_key, context, Some(server_key))
+    }
+
+    fn with_context(
+        client_key: ClientKey,
+        context: KeyContext,
+        compressed_server_key: Option<CompressedServerKey>,
+    ) -> Self {
+        context.install();
         Self {
             client_key,
-            server_key,
+            context,
+            compressed_server_key: compressed_server_key.map(Arc::new),
         }
     }
 
     pub fn enc_false(&self) -> FheBool {
-        set_server_key(self.server_key.clone());
         FheBool::encrypt(false, &self.client_key)
     }
 
     pub fn enc_true(&self) -> FheBool {
-        set_server_key(self.server_key.clone());
         FheBool::encrypt(true, &self.client_key)
     }
 
     pub fn enc_u32(&self, val: u32) -> FheUint32 {
-        set_server_key(self.server_key.clone());
         FheUint32::encrypt(val, &self.client_key)
     }
 
     pub fn enc_u64(&self, val: u64) -> FheUint64 {
-        set_server_key(self.server_key.clone());
         FheUint64::encrypt(val, &self.client_key)
     }
 
     pub fn enc_zero_u32(&self) -> FheUint32 {
-        set_server_key(self.server_key.clone());
         FheUint32::encrypt(0u32, &self.client_key)
     }
 
     pub fn enc_zero_u64(&self) -> FheUint64 {
-        set_server_key(self.server_key.clone());
         FheUint64::encrypt(0u64, &self.client_key)
     }
 
-    pub fn build_enc_indices_u32(&self, count: usize) -> Vec<FheUint32> {
-        set_server_key(self.server_key.clone());
-        let mut table = Vec::with_capacity(count);
-        for idx in 0..count {
-            table.push(self.enc_u32(idx as u32));
-        }
-        table
+    pub fn build_enc_offsets_u64(&self, count: usize, block_size: usize) -> Vec<FheUint64> {
+        (0..count)
+            .into_par_iter()
+            .map(|idx| self.enc_u64((idx * block_size) as u64))
+            .collect()
     }
 
-    pub fn build_enc_offsets_u64(&self, count: usize, block_size: usize) -> Vec<FheUint64> {
-        set_server_key(self.server_key.clone());
-        let mut table = Vec::with_capacity(count);
-        for idx in 0..count {
-            let offset = (idx * block_size) as u64;
-            table.push(self.enc_u64(offset));
-        }
-        table
+    /// encrypts one value as whichever pointer word the allocator runs on.
+    pub fn enc_word<W: PtrWord>(&self, value: u64) -> W {
+        W::encrypt_word(value, &self.client_key)
+    }
+
+    /// builds the offset-table entries of one tier's `blocks` the way `construction` asks, in the allocator's pointer word; a growing tier asks only for its new blocks.
+    pub fn build_tables<W: PtrWord>(
+        &self,
+        blocks: Range<usize>,
+        block_size: usize,
+        construction: TableConstruction,
+    ) -> Vec<W> {
+        let context = &self.context;
+        blocks
+            .into_par_iter()
+            .map(|idx| {
+                let offset = (idx * block_size) as u64;
+                match construction {
+                    TableConstruction::Encrypted => self.enc_word(offset),
+                    TableConstruction::Trivial => {
+                        context.install();
+                        W::trivial_word(offset)
+                    }
+                }
+            })
+            .collect()
     }
 
-    pub fn server_key(&self) -> ServerKey {
-        set_server_key(self.server_key.clone());
-        self.server_key.clone()
+    /// exposes the client key for decrypting results at the trust boundary; allocator internals never call this.
+    pub fn client_key(&self) -> &ClientKey {
+        &self.client_key
+    }
+
+    pub fn server_key(&self) -> &ServerKey {
+        self.context.server_key()
+    }
+
+    pub fn context(&self) -> &KeyContext {
+        &self.context
     }
 }
 
@@ -97,26 +455,24 @@ impl Default for Keys {
     }
 }
 
-fn install_global_server_key(server_key: &ServerKey) {
-    if let Ok(mut slot) = GLOBAL_SERVER_KEY.write() {
-        *slot = Some(server_key.clone());
-    }
+fn write_keys(
+    client_key: &ClientKey,
+    server_key: &CompressedServerKey,
+    mut writer: impl Write,
+) -> io::Result<()> {
+    safe_serialize(client_key, &mut writer, KEY_SERIALIZATION_LIMIT).map_err(invalid_data)?;
+    safe_serialize(server_key, &mut writer, KEY_SERIALIZATION_LIMIT).map_err(invalid_data)?;
+    writer.flush()
 }
 
-#[allow(dead_code)]
-pub(crate) fn refresh_global_server_key() {
-    if let Ok(slot) = GLOBAL_SERVER_KEY.read() {
-        if let Some(server_key) = slot.as_ref() {
-            set_server_key(server_key.clone());
-        }
-    }
+fn read_keys(mut reader: impl Read) -> io::Result<(ClientKey, CompressedServerKey)> {
+    let client_key =
+        safe_deserialize(&mut reader, KEY_SERIALIZATION_LIMIT).map_err(invalid_data)?;
+    let server_key =
+        safe_deserialize(&mut reader, KEY_SERIALIZATION_LIMIT).map_err(invalid_data)?;
+    Ok((client_key, server_key))
 }
 
-pub(crate) fn clone_global_server_key() -> Option<ServerKey> {
-    if let Ok(slot) = GLOBAL_SERVER_KEY.read() {
-        if let Some(server_key) = slot.as_ref() {
-            return Some(server_key.clone());
-        }
-    }
-    None
+pub(crate) fn invalid_data(message: impl fmt::Display) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message.to_string())
 }
@@ -6,13 +6,38 @@ pub mod arena;
 pub mod encrypted_option;
 pub mod encrypted_ptr;
 pub mod evm;
+pub mod heap;
 pub mod keys;
+pub mod metrics;
+pub mod oblivious;
+pub mod packed;
+pub mod scan;
+pub mod service;
+pub mod sharded;
 pub mod slab;
+pub mod snapshot;
+pub mod word;
 
-pub use allocator::CryptMalloc;
-pub use arena::Arena;
+pub use allocator::{
+    CryptMalloc, LayoutCost, RoutingMode, TierGrowth, ARENA_ALIGN, DEFAULT_FREE_QUEUE_LIMIT,
+    SIZE_CLASSES,
+};
+pub use arena::{Arena, DEFAULT_ARENA_FREE_SLOTS};
 pub use encrypted_option::EncryptedOption;
 pub use encrypted_ptr::EncryptedPtr;
-pub use evm::EVM;
-pub use keys::Keys;
-pub use slab::SlabClass;
+pub use evm::{Opcode, EVM, STACK_CAPACITY};
+pub use heap::Heap;
+pub use keys::{
+    KeyContext, KeyGuard, Keys, ParameterProfile, TableConstruction, KEY_SERIALIZATION_LIMIT,
+};
+pub use metrics::Phase;
+#[cfg(feature = "metrics")]
+pub use metrics::{HistogramSink, LatencyHistogram, MetricsSink, PhaseSample};
+pub use oblivious::{ObliviousMemory, ScanMemory};
+pub use packed::{BitmapLayout, PackedBitmap};
+pub use scan::SelectionMode;
+pub use service::{AllocService, BatchPolicy, Pending, DEFAULT_MAX_BATCH, DEFAULT_MAX_DELAY};
+pub use sharded::{ShardHandle, ShardedCryptMalloc};
+pub use slab::{AddressCache, FreeStrategy, SlabClass};
+pub use snapshot::{SNAPSHOT_CHUNK, SNAPSHOT_VERSION};
+pub use word::{narrowest_pointer_bits, PtrWord};
@@ -0,0 +1,203 @@
+//! metrics times the allocator's phases (routing, each slab tier, the arena, the final fold, and whole `allocate`/`free` calls) and hands every measurement to a process-wide `MetricsSink`.
+//! With the `metrics` feature each phase also runs inside a `tracing` span named after it; without the feature `phase` compiles down to the wrapped call.
+//! Nothing recorded depends on ciphertext contents: phases, tiers and PBS counts follow from the public layout, and durations are what an observer of the host already sees.
+//! PBS counts need the `pbs-stats` feature; tfhe keeps one process-wide counter, so a phase that overlaps other work (parallel routing, shards, the service pool) also counts those bootstraps.
+
+#[cfg(feature = "metrics")]
+use std::{
+    collections::HashMap,
+    sync::{Arc, Mutex, RwLock},
+    time::{Duration, Instant},
+};
+
+/// one instrumented step of an allocator call.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash)]
+pub enum Phase {
+    /// a whole `CryptMalloc::allocate`.
+    Allocate,
+    /// a whole `CryptMalloc::allocate_many`.
+    AllocateMany,
+    /// a whole `CryptMalloc::reallocate`.
+    Reallocate,
+    /// a whole `CryptMalloc::calloc`.
+    Calloc,
+    /// a whole `CryptMalloc::free`.
+    Free,
+    /// a whole `CryptMalloc::flush_frees`.
+    FlushFrees,
+    /// the tier comparisons that build the one-hot masks.
+    Route,
+    /// one slab tier's scan; the sample carries the tier index.
+    Slab,
+    /// the arena bump or free-list pass.
+    Arena,
+    /// the `combine_with` fold over the sub-allocation results.
+    Combine,
+}
+
+impl Phase {
+    pub fn name(self) -> &'static str {
+        match self {
+            Self::Allocate => "allocate",
+            Self::AllocateMany => "allocate_many",
+            Self::Reallocate => "reallocate",
+            Self::Calloc => "calloc",
+            Self::Free => "free",
+            Self::FlushFrees => "flush_frees",
+            Self::Route => "route",
+            Self::Slab => "slab",
+            Self::Arena => "arena",
+            Self::Combine => "combine",
+        }
+    }
+}
+
+/// one finished phase.
+#[cfg(feature = "metrics")]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct PhaseSample {
+    pub phase: Phase,
+    /// the slab tier for `Phase::Slab`, `None` otherwise.
+    pub tier: Option<usize>,
+    pub elapsed: Duration,
+    /// programmable bootstraps tfhe counted during the phase; `None` without the `pbs-stats` feature.
+    pub pbs: Option<u64>,
+}
+
+/// receives every `PhaseSample`; called on whichever thread ran the phase, so implementations must be cheap and thread-safe.
+#[cfg(feature = "metrics")]
+pub trait MetricsSink: Send + Sync {
+    fn record(&self, sample: &PhaseSample);
+}
+
+#[cfg(feature = "metrics")]
+static SINK: RwLock<Option<Arc<dyn MetricsSink>>> = RwLock::new(None);
+
+/// installs the process-wide sink, replacing any earlier one; `None` stops recording.
+#[cfg(feature = "metrics")]
+pub fn set_sink(sink: Option<Arc<dyn MetricsSink>>) {
+    *SINK
+        .write()
+        .unwrap_or_else(|poisoned| poisoned.into_inner()) = sink;
+}
+
+#[cfg(feature = "metrics")]
+fn current_sink() -> Option<Arc<dyn MetricsSink>> {
+    SINK.read()
+        .unwrap_or_else(|poisoned| poisoned.into_inner())
+        .clone()
+}
+
+#[cfg(all(feature = "metrics", feature = "pbs-stats"))]
+fn pbs_count() -> Option<u64> {
+    Some(tfhe::get_pbs_count())
+}
+
+#[cfg(all(feature = "metrics", not(feature = "pbs-stats")))]
+fn pbs_count() -> Option<u64> {
+    None
+}
+
+/// runs `op` as one instrumented phase: inside a `tracing` span, timed, and reported to the installed sink.
+#[cfg(feature = "metrics")]
+pub(crate) fn phase<R>(phase: Phase, tier: Option<usize>, op: impl FnOnce() -> R) -> R {
+    let span = tracing::debug_span!("cryptmalloc", phase = phase.name(), tier);
+    let _entered = span.enter();
+    let Some(sink) = current_sink() else {
+        return op();
+    };
+    let pbs_before = pbs_count();
+    let start = Instant::now();
+    let result = op();
+    let elapsed = start.elapsed();
+    let pbs = pbs_count()
+        .zip(pbs_before)
+        .map(|(after, before)| after.saturating_sub(before));
+    sink.record(&PhaseSample {
+        phase,
+        tier,
+        elapsed,
+        pbs,
+    });
+    result
+}
+
+#[cfg(not(feature = "metrics"))]
+#[inline(always)]
+pub(crate) fn phase<R>(_phase: Phase, _tier: Option<usize>, op: impl FnOnce() -> R) -> R {
+    op()
+}
+
+/// number of power-of-two buckets in a `LatencyHistogram`; the last one also holds everything slower.
+#[cfg(feature = "metrics")]
+pub const HISTOGRAM_BUCKETS: usize = 40;
+
+/// latency distribution with power-of-two microsecond buckets: bucket `i` counts phases that took less than `2^i` µs and at least half that.
+#[cfg(feature = "metrics")]
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct LatencyHistogram {
+    pub buckets: [u64; HISTOGRAM_BUCKETS],
+    pub calls: u64,
+    pub total: Duration,
+    /// summed PBS counts; stays zero without the `pbs-stats` feature.
+    pub pbs: u64,
+}
+
+#[cfg(feature = "metrics")]
+impl Default for LatencyHistogram {
+    fn default() -> Self {
+        Self {
+            buckets: [0; HISTOGRAM_BUCKETS],
+            calls: 0,
+            total: Duration::ZERO,
+            pbs: 0,
+        }
+    }
+}
+
+#[cfg(feature = "metrics")]
+impl LatencyHistogram {
+    pub fn record(&mut self, sample: &PhaseSample) {
+        let micros = u64::try_from(sample.elapsed.as_micros()).unwrap_or(u64::MAX);
+        let bucket = (u64::BITS - micros.leading_zeros()) as usize;
+        self.buckets[bucket.min(HISTOGRAM_BUCKETS - 1)] += 1;
+        self.calls += 1;
+        self.total += sample.elapsed;
+        self.pbs += sample.pbs.unwrap_or(0);
+    }
+
+    /// average PBS per call, the figure to size hardware against.
+    pub fn mean_pbs(&self) -> Option<u64> {
+        (self.calls > 0).then(|| self.pbs / self.calls)
+    }
+}
+
+/// ready-made sink keeping one `LatencyHistogram` per phase and tier.
+#[cfg(feature = "metrics")]
+#[derive(Debug, Default)]
+pub struct HistogramSink {
+    histograms: Mutex<HashMap<(Phase, Option<usize>), LatencyHistogram>>,
+}
+
+#[cfg(feature = "metrics")]
+impl HistogramSink {
+    /// a copy of every histogram recorded so far.
+    pub fn snapshot(&self) -> HashMap<(Phase, Option<usize>), LatencyHistogram> {
+        self.histograms
+            .lock()
+            .unwrap_or_else(|poisoned| poisoned.into_inner())
+            .clone()
+    }
+}
+
+#[cfg(feature = "metrics")]
+impl MetricsSink for HistogramSink {
+    fn record(&self, sample: &PhaseSample) {
+        self.histograms
+            .lock()
+            .unwrap_or_else(|poisoned| poisoned.into_inner())
+            .entry((sample.phase, sample.tier))
+            .or_default()
+            .record(sample);
+    }
+}
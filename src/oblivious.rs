@@ -0,0 +1,210 @@
+//! oblivious is the pluggable random-access layer for encrypted memories: a backend reads and writes a fixed number of cells at an encrypted index without revealing which cell it touched.
+//! `ScanMemory` is the single-party backend: it lays the cells out in a public grid of rows by power-of-two columns, so an index decodes into two short one-hot vectors (about 2·sqrt(N) scalar equalities) instead of one equality per cell, and every cell is then touched by one boolean AND plus a mux.
+//! Tree ORAMs only beat a scan when some party learns each access's leaf label; the evaluator here holds no client key, so the label would stay encrypted and the path fetch would become a scan again.
+
+use crate::{
+    keys::KeyContext,
+    scan::{inclusive_prefix_or, one_hot_select},
+    word::PtrWord,
+};
+use rayon::prelude::*;
+use tfhe::{prelude::*, FheBool, FheUint32, FheUint64};
+
+/// an encrypted, fixed-length memory addressed by encrypted `FheUint32` indices; out-of-range indices read zero and write nothing.
+pub trait ObliviousMemory<T> {
+    fn len(&self) -> usize;
+
+    fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// the cell at `index` when `condition` holds, zero otherwise.
+    fn read(&self, index: &FheUint32, condition: &FheBool) -> T;
+
+    /// overwrites the cell at `index` with `value` when `condition` holds.
+    fn write(&mut self, index: &FheUint32, value: &T, condition: &FheBool);
+}
+
+/// fixed-size grid of ciphertext cells; each access decodes the index once and then visits every cell in parallel.
+#[derive(Clone)]
+pub struct ScanMemory<T = FheUint64> {
+    cells: Vec<T>,
+    column_bits: u32,
+    context: KeyContext,
+    zero: T,
+}
+
+impl<T> core::fmt::Debug for ScanMemory<T> {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("ScanMemory")
+            .field("len", &self.cells.len())
+            .field("columns", &(1usize << self.column_bits))
+            .finish()
+    }
+}
+
+impl<T: PtrWord> ScanMemory<T> {
+    /// `len` cells, each a copy of `zero`; the column count is the power of two nearest above sqrt(len).
+    pub fn new(len: usize, zero: T, context: KeyContext) -> Self {
+        let columns = (len as f64).sqrt().ceil() as usize;
+        let column_bits = columns.max(1).next_power_of_two().trailing_zeros();
+        Self {
+            cells: vec![zero.clone(); len],
+            column_bits,
+            context,
+            zero,
+        }
+    }
+
+    pub fn cells(&self) -> &[T] {
+        &self.cells
+    }
+
+    /// reads one cell per `(index, condition)` access, the accesses in parallel; a false condition reads zero.
+    pub fn read_many(&self, accesses: &[(FheUint32, FheBool)]) -> Vec<T> {
+        let _guard = self.context.enter();
+        accesses
+            .par_iter()
+            .map(|(index, condition)| {
+                self.context.install();
+                self.read(index, condition)
+            })
+            .collect()
+    }
+
+    /// applies `values[k]` at `accesses[k]` in order, so a later write to the same cell wins; the selectors are decoded in parallel and every cell is then visited once.
+    pub fn write_many(&mut self, accesses: &[(FheUint32, FheBool)], values: &[T]) {
+        let _guard = self.context.enter();
+        let context = &self.context;
+        let selectors: Vec<Vec<FheBool>> = accesses
+            .par_iter()
+            .map(|(index, condition)| {
+                context.install();
+                self.selectors(index, condition)
+            })
+            .collect();
+        self.cells.par_iter_mut().enumerate().for_each(|(i, cell)| {
+            context.install();
+            for (selected, value) in selectors.iter().zip(values) {
+                *cell = T::select(&selected[i], value, cell);
+            }
+        });
+    }
+
+    /// reads the `len` cells from `start` on with a single index decode: cell `start + k` is picked by the start's one-hot selectors shifted by the public `k`, so only the muxes grow with `len`.
+    /// Cells past the end read zero.
+    pub fn read_run(&self, start: &FheUint32, len: usize, condition: &FheBool) -> Vec<T> {
+        let _guard = self.context.enter();
+        let selectors = self.selectors(start, condition);
+        (0..len)
+            .into_par_iter()
+            .map(|offset| {
+                self.context.install();
+                let tail = self.cells.get(offset..).unwrap_or(&[]);
+                one_hot_select(&selectors[..tail.len()], tail, &self.zero, &self.context)
+            })
+            .collect()
+    }
+
+    /// writes `values` to the consecutive cells from `start` on, decoding `start` once; writes past the end are dropped.
+    pub fn write_run(&mut self, start: &FheUint32, values: &[T], condition: &FheBool) {
+        let _guard = self.context.enter();
+        let selectors = self.selectors(start, condition);
+        let context = &self.context;
+        self.cells.par_iter_mut().enumerate().for_each(|(i, cell)| {
+            context.install();
+            for (offset, value) in values.iter().enumerate().take(i + 1) {
+                *cell = T::select(&selectors[i - offset], value, cell);
+            }
+        });
+    }
+
+    /// sets the `len` cells from `start` on to `value`: a prefix-OR over the start's selectors marks every cell at or after it, and the window is that prefix minus the one `len` cells earlier.
+    pub fn fill_run(&mut self, start: &FheUint32, len: usize, value: &T, condition: &FheBool) {
+        let _guard = self.context.enter();
+        let mut reached = self.selectors(start, condition);
+        inclusive_prefix_or(&mut reached, &self.context);
+        let context = &self.context;
+        let window: Vec<FheBool> = (0..reached.len())
+            .into_par_iter()
+            .map(|i| {
+                context.install();
+                match i.checked_sub(len) {
+                    Some(before) => &reached[i] & !&reached[before],
+                    None => reached[i].clone(),
+                }
+            })
+            .collect();
+        self.overwrite(&window, value);
+    }
+
+    /// overwrites every cell whose flag in `mask` holds with `value`, the cells in parallel.
+    pub(crate) fn overwrite(&mut self, mask: &[FheBool], value: &T) {
+        let context = &self.context;
+        self.cells
+            .par_iter_mut()
+            .zip(mask.par_iter())
+            .for_each(|(cell, selected)| {
+                context.install();
+                *cell = T::select(selected, value, cell);
+            });
+    }
+
+    /// one-hot cell selectors for `index`, already masked by `condition`: row flags come from the high bits, column flags from the low bits, and cell `i` is their AND.
+    fn selectors(&self, index: &FheUint32, condition: &FheBool) -> Vec<FheBool> {
+        let context = &self.context;
+        let columns = 1usize << self.column_bits;
+        let rows = self.cells.len().div_ceil(columns);
+
+        let (row_flags, column_flags): (Vec<FheBool>, Vec<FheBool>) = rayon::join(
+            || {
+                context.install();
+                let row = index >> self.column_bits;
+                (0..rows)
+                    .into_par_iter()
+                    .map(|r| {
+                        context.install();
+                        row.eq(r as u32) & condition
+                    })
+                    .collect()
+            },
+            || {
+                context.install();
+                let column = index & (columns as u32 - 1);
+                (0..columns)
+                    .into_par_iter()
+                    .map(|c| {
+                        context.install();
+                        column.eq(c as u32)
+                    })
+                    .collect()
+            },
+        );
+
+        (0..self.cells.len())
+            .into_par_iter()
+            .map(|i| {
+                context.install();
+                &row_flags[i >> self.column_bits] & &column_flags[i & (columns - 1)]
+            })
+            .collect()
+    }
+}
+
+impl<T: PtrWord> ObliviousMemory<T> for ScanMemory<T> {
+    fn len(&self) -> usize {
+        self.cells.len()
+    }
+
+    fn read(&self, index: &FheUint32, condition: &FheBool) -> T {
+        let _guard = self.context.enter();
+        let selectors = self.selectors(index, condition);
+        one_hot_select(&selectors, &self.cells, &self.zero, &self.context)
+    }
+
+    fn write(&mut self, index: &FheUint32, value: &T, condition: &FheBool) {
+        let _guard = self.context.enter();
+        let selectors = self.selectors(index, condition);
+        self.overwrite(&selectors, value);
+    }
+}
@@ -0,0 +1,249 @@
+//! PackedBitmap stores slab occupancy as `FheUint64` words with 64 flags each (bit set = allocated), replacing one `FheBool` ciphertext per block.
+//! Padding bits past the tier end are stored as allocated, so word-level scans never need to know the tier length; every word is read and rewritten on every scan regardless of content.
+
+use crate::{
+    keys::KeyContext,
+    scan::{inclusive_prefix_or, one_hot_select},
+    word::PtrWord,
+};
+use rayon::prelude::*;
+use tfhe::{prelude::*, FheBool, FheUint16, FheUint32, FheUint64};
+
+pub const FLAGS_PER_WORD: usize = 64;
+
+/// picks how a slab stores its occupancy bits; the layout is public configuration and both layouts answer every `SlabClass` call identically.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum BitmapLayout {
+    /// one `FheBool` per block.
+    #[default]
+    Flags,
+    /// 64 blocks per `FheUint64` word; requires a power-of-two block size so pointers decode to bit positions.
+    Packed,
+}
+
+#[derive(Clone)]
+pub struct PackedBitmap {
+    words: Vec<FheUint64>,
+    len: usize,
+    zero: FheUint64,
+}
+
+impl PackedBitmap {
+    pub fn from_flags(flags: &[FheBool], context: &KeyContext) -> Self {
+        let words = flags
+            .par_chunks(FLAGS_PER_WORD)
+            .map(|chunk| {
+                context.install();
+                let mut word = FheUint64::cast_from(chunk[0].clone());
+                for (bit, flag) in chunk.iter().enumerate().skip(1) {
+                    word |= FheUint64::cast_from(flag.clone()) << bit as u32;
+                }
+                if chunk.len() < FLAGS_PER_WORD {
+                    word |= u64::MAX << chunk.len();
+                }
+                word
+            })
+            .collect();
+        Self {
+            words,
+            len: flags.len(),
+            zero: FheUint64::encrypt_trivial(0u64),
+        }
+    }
+
+    /// rebuilds a bitmap of `len` flags from words written by `words`; needs the server key installed.
+    pub(crate) fn from_words(words: Vec<FheUint64>, len: usize) -> Self {
+        Self {
+            words,
+            len,
+            zero: FheUint64::encrypt_trivial(0u64),
+        }
+    }
+
+    pub fn to_flags(&self, context: &KeyContext) -> Vec<FheBool> {
+        let per_word: Vec<Vec<FheBool>> = self
+            .words
+            .par_iter()
+            .enumerate()
+            .map(|(w, word)| {
+                context.install();
+                let used = FLAGS_PER_WORD.min(self.len - w * FLAGS_PER_WORD);
+                (0..used)
+                    .map(|bit| ((word >> bit as u32) & 1u64).eq(1u64))
+                    .collect()
+            })
+            .collect();
+        per_word.into_iter().flatten().collect()
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    pub fn words(&self) -> &[FheUint64] {
+        &self.words
+    }
+
+    #[cfg(feature = "gpu")]
+    pub(crate) fn move_to_current_device(&mut self, context: &KeyContext) {
+        context.move_to_device(&mut self.words, FheUint64::move_to_current_device);
+        self.zero.move_to_current_device();
+    }
+
+    /// finds the lowest free bit of the first word that has one, sets it under `requested_mask`, and returns its absolute address `base + index << shift`.
+    /// Within a word the lowest free bit is isolated with `free & -free` and located with `trailing_zeros`; across words the same prefix-OR as the flag layout picks the word.
+    pub fn select_first_free<W: PtrWord>(
+        &mut self,
+        requested_mask: &FheBool,
+        base: u64,
+        shift: u32,
+        enc_zero_word: &W,
+        enc_false: &FheBool,
+        context: &KeyContext,
+    ) -> (W, FheBool) {
+        let (value, is_some, set) = self.claim_first_free(
+            requested_mask,
+            base,
+            shift,
+            enc_zero_word,
+            enc_false,
+            context,
+        );
+        self.update(Some(&set), &[], context);
+        (value, is_some)
+    }
+
+    /// `select_first_free` without the write: the address, the success flag and the bit each word would gain, for `update` to apply.
+    pub fn claim_first_free<W: PtrWord>(
+        &self,
+        requested_mask: &FheBool,
+        base: u64,
+        shift: u32,
+        enc_zero_word: &W,
+        enc_false: &FheBool,
+        context: &KeyContext,
+    ) -> (W, FheBool, Vec<FheUint64>) {
+        let free: Vec<FheUint64> = self
+            .words
+            .par_iter()
+            .map(|word| {
+                context.install();
+                !word
+            })
+            .collect();
+        let has_free: Vec<FheBool> = free
+            .par_iter()
+            .map(|bits| {
+                context.install();
+                bits.ne(0u64)
+            })
+            .collect();
+        let mut seen_free = has_free.clone();
+        inclusive_prefix_or(&mut seen_free, context);
+
+        let word_sel: Vec<FheBool> = (0..self.words.len())
+            .into_par_iter()
+            .map(|w| {
+                context.install();
+                let first = if w == 0 {
+                    has_free[0].clone()
+                } else {
+                    (&has_free[w]) & !(&seen_free[w - 1])
+                };
+                first & requested_mask
+            })
+            .collect();
+
+        let candidates: Vec<W> = free
+            .par_iter()
+            .enumerate()
+            .map(|(w, bits)| {
+                context.install();
+                let word_base = base + (((w * FLAGS_PER_WORD) as u64) << shift);
+                let bit = W::from_count(bits.trailing_zeros());
+                bit.scalar_shl(shift).scalar_add(word_base)
+            })
+            .collect();
+        let value = one_hot_select(&word_sel, &candidates, enc_zero_word, context);
+
+        let set = free
+            .par_iter()
+            .zip(word_sel.par_iter())
+            .map(|(bits, sel)| {
+                context.install();
+                let lowest = bits & &(-bits);
+                sel.if_then_else(&lowest, &self.zero)
+            })
+            .collect();
+
+        let is_some = match seen_free.last() {
+            Some(any_free) => any_free & requested_mask,
+            None => enc_false.clone(),
+        };
+        (value, is_some, set)
+    }
+
+    /// clears bit `index` when `valid` holds; the cleared mask is `valid << (index % 64)`, so an invalid pointer rewrites every word with itself.
+    pub fn clear_index(&mut self, index: &FheUint64, valid: &FheBool, context: &KeyContext) {
+        self.clear_indices(&[(index.clone(), valid.clone())], context);
+    }
+
+    /// clears every `(index, valid)` bit in one pass: each word ORs the masks of all entries that land in it and is rewritten once.
+    pub fn clear_indices(&mut self, decoded: &[(FheUint64, FheBool)], context: &KeyContext) {
+        self.update(None, decoded, context);
+    }
+
+    /// rewrites every word once as `(word | set) & !clear`, where `set` holds one mask per word (from `claim_first_free`) and `clear` the `(index, valid)` bits to release.
+    pub fn update(
+        &mut self,
+        set: Option<&[FheUint64]>,
+        clear: &[(FheUint64, FheBool)],
+        context: &KeyContext,
+    ) {
+        let targets: Vec<(FheUint16, FheUint64)> = clear
+            .par_iter()
+            .map(|(index, valid)| {
+                context.install();
+                let word_index = FheUint16::cast_from(index >> 6u32);
+                let valid_bit = FheUint64::cast_from(valid.clone());
+                (
+                    word_index,
+                    &valid_bit << &(index & (FLAGS_PER_WORD as u64 - 1)),
+                )
+            })
+            .collect();
+
+        self.words.par_iter_mut().enumerate().for_each(|(w, word)| {
+            context.install();
+            if let Some(set) = set {
+                *word |= &set[w];
+            }
+            let clear = targets
+                .iter()
+                .map(|(word_index, bit)| word_index.eq(w as u16).if_then_else(bit, &self.zero))
+                .reduce(|left, right| left | right);
+            if let Some(clear) = clear {
+                *word &= !clear;
+            }
+        });
+    }
+
+    /// encrypted number of free blocks; padding bits count as allocated, so a word's zero count is exactly its free blocks.
+    pub fn count_free(&self, enc_zero_u32: &FheUint32, context: &KeyContext) -> FheUint32 {
+        self.words
+            .par_iter()
+            .map(|word| {
+                context.install();
+                word.count_zeros()
+            })
+            .reduce_with(|left, right| {
+                context.install();
+                left + right
+            })
+            .unwrap_or_else(|| enc_zero_u32.clone())
+    }
+}
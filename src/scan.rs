@@ -0,0 +1,120 @@
+//! scan holds the log-depth building blocks shared by the slab selection paths: a Brent-Kung inclusive scan (prefix-OR over flags, prefix sums over counts) and a balanced OR-reduction of one-hot muxed payloads.
+//! Every level touches a fixed, public set of indices, so the schedule depends only on the slice length and never on ciphertext contents; rayon workers install the caller's `KeyContext` before touching a ciphertext.
+
+use crate::{keys::KeyContext, word::PtrWord};
+use rayon::prelude::*;
+use tfhe::FheBool;
+
+/// selects how a slab locates its first free block; every mode visits every block and returns the same ciphertext result.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum SelectionMode {
+    /// sequential `selected | should_sel` chain, one block per step; depth grows linearly with the tier.
+    #[default]
+    Linear,
+    /// Brent-Kung prefix-OR over the free flags plus parallel one-hot muxes; depth grows with log2 of the tier.
+    PrefixOr,
+    /// two-level search over groups of about sqrt(N) blocks: an encrypted per-group "has a free block" summary picks the group, then a prefix-OR inside the gathered group picks the block; depth and mux chains grow with log2 of sqrt(N).
+    Grouped,
+}
+
+/// rewrites `flags[i]` into `flags[0] | ... | flags[i]`.
+pub(crate) fn inclusive_prefix_or(flags: &mut [FheBool], context: &KeyContext) {
+    inclusive_scan(flags, |left, right| left | right, context);
+}
+
+/// one-hot marks the first set flag: entry `i` is `flags[i] & !(flags[0] | ... | flags[i - 1])`; the second value is the OR of every flag, `None` for an empty slice.
+pub(crate) fn first_set(
+    flags: &[FheBool],
+    context: &KeyContext,
+) -> (Vec<FheBool>, Option<FheBool>) {
+    let mut seen = flags.to_vec();
+    inclusive_prefix_or(&mut seen, context);
+
+    let first = (0..flags.len())
+        .into_par_iter()
+        .map(|i| {
+            context.install();
+            match i {
+                0 => flags[0].clone(),
+                _ => &flags[i] & !&seen[i - 1],
+            }
+        })
+        .collect();
+    (first, seen.pop())
+}
+
+/// rewrites `values[i]` into `combine(values[0], ..., values[i])` with a work-efficient Brent-Kung up-sweep/down-sweep; `combine` must be associative.
+/// Each level's writes are disjoint from its reads, so a level runs fully in parallel.
+pub(crate) fn inclusive_scan<T, F>(values: &mut [T], combine: F, context: &KeyContext)
+where
+    T: Send + Sync,
+    F: Fn(&T, &T) -> T + Sync,
+{
+    let len = values.len();
+    let mut stride = 1;
+    while stride < len {
+        let targets: Vec<usize> = (2 * stride - 1..len).step_by(2 * stride).collect();
+        apply_level(values, &targets, stride, &combine, context);
+        stride *= 2;
+    }
+    stride /= 2;
+    while stride >= 1 {
+        let targets: Vec<usize> = (3 * stride - 1..len).step_by(2 * stride).collect();
+        apply_level(values, &targets, stride, &combine, context);
+        stride /= 2;
+    }
+}
+
+fn apply_level<T, F>(
+    values: &mut [T],
+    targets: &[usize],
+    stride: usize,
+    combine: &F,
+    context: &KeyContext,
+) where
+    T: Send + Sync,
+    F: Fn(&T, &T) -> T + Sync,
+{
+    let snapshot: &[T] = values;
+    let updates: Vec<T> = targets
+        .par_iter()
+        .map(|&idx| {
+            context.install();
+            combine(&snapshot[idx - stride], &snapshot[idx])
+        })
+        .collect();
+    for (&idx, updated) in targets.iter().zip(updates) {
+        values[idx] = updated;
+    }
+}
+
+/// ORs `values[i]` masked by a one-hot `selectors[i]` in a balanced tree; with at most one selector set this equals a mux chain but has log2 depth instead of linear.
+pub(crate) fn one_hot_select<W: PtrWord>(
+    selectors: &[FheBool],
+    values: &[W],
+    zero: &W,
+    context: &KeyContext,
+) -> W {
+    one_hot_select_by(selectors, |i| &values[i], zero, context)
+}
+
+/// `one_hot_select` with value `i` borrowed through `value(i)`, e.g. a field of each record or every `width`-th entry, so callers need not copy the payloads into a scratch vector first.
+pub(crate) fn one_hot_select_by<'a, W: PtrWord + 'a>(
+    selectors: &[FheBool],
+    value: impl Fn(usize) -> &'a W + Sync,
+    zero: &W,
+    context: &KeyContext,
+) -> W {
+    selectors
+        .par_iter()
+        .enumerate()
+        .map(|(i, sel)| {
+            context.install();
+            W::select(sel, value(i), zero)
+        })
+        .reduce_with(|left, right| {
+            context.install();
+            left.bitor(&right)
+        })
+        .unwrap_or_else(|| zero.clone())
+}
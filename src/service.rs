@@ -0,0 +1,250 @@
+//! service puts an asynchronous front end on one `CryptMalloc`: callers submit encrypted allocations and frees from any thread and get back std futures, while a single worker thread owns the allocator and drains the queue in micro-batches.
+//! A batch closes once it holds `BatchPolicy::max_batch` requests or `max_delay` after its first request arrived; its frees run through one `flush_frees` pass and its allocations through one `allocate_many` call, both on a dedicated rayon pool.
+//! Batch boundaries follow from arrival times and request counts, which the host sees anyway; every batch of a given shape does the same ciphertext work.
+
+use crate::{
+    allocator::CryptMalloc, encrypted_option::EncryptedOption, encrypted_ptr::EncryptedPtr,
+    word::PtrWord,
+};
+use core::fmt;
+use std::{
+    future::Future,
+    io,
+    pin::Pin,
+    sync::{
+        mpsc::{self, Receiver, Sender},
+        Arc, Mutex,
+    },
+    task::{Context, Poll, Waker},
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+use tfhe::FheUint64;
+
+/// requests per batch when `BatchPolicy::default` is used.
+pub const DEFAULT_MAX_BATCH: usize = 16;
+/// how long a batch waits for company after its first request when `BatchPolicy::default` is used.
+pub const DEFAULT_MAX_DELAY: Duration = Duration::from_millis(2);
+
+/// when the worker closes a batch and how many threads compute it.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct BatchPolicy {
+    /// largest number of requests, allocations and frees together, in one batch; at least one.
+    pub max_batch: usize,
+    /// longest wait between a batch's first request and its execution.
+    pub max_delay: Duration,
+    /// compute pool size; zero lets rayon pick one thread per core.
+    pub threads: usize,
+}
+
+impl Default for BatchPolicy {
+    fn default() -> Self {
+        Self {
+            max_batch: DEFAULT_MAX_BATCH,
+            max_delay: DEFAULT_MAX_DELAY,
+            threads: 0,
+        }
+    }
+}
+
+enum Request<W: Clone> {
+    Allocate(W, Completion<EncryptedOption<EncryptedPtr<W>>>),
+    Free(EncryptedPtr<W>, Completion<()>),
+}
+
+struct Slot<T> {
+    value: Option<T>,
+    waker: Option<Waker>,
+    abandoned: bool,
+}
+
+type SharedSlot<T> = Arc<Mutex<Slot<T>>>;
+
+/// the worker's end of one request; dropping it unanswered, e.g. when the worker panics, wakes the caller with an abandoned slot.
+struct Completion<T>(SharedSlot<T>);
+
+impl<T> Completion<T> {
+    fn complete(self, value: T) {
+        let mut slot = self.0.lock().expect("a caller panicked while polling");
+        slot.value = Some(value);
+    }
+}
+
+impl<T> Drop for Completion<T> {
+    fn drop(&mut self) {
+        let mut slot = self.0.lock().expect("a caller panicked while polling");
+        slot.abandoned = slot.value.is_none();
+        if let Some(waker) = slot.waker.take() {
+            waker.wake();
+        }
+    }
+}
+
+/// resolves once the worker has run the batch holding this request; polling panics if the service stopped before answering.
+pub struct Pending<T>(SharedSlot<T>);
+
+impl<T> fmt::Debug for Pending<T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let slot = self.0.lock().expect("the service panicked while answering");
+        f.debug_struct("Pending")
+            .field("ready", &slot.value.is_some())
+            .finish()
+    }
+}
+
+impl<T> Future for Pending<T> {
+    type Output = T;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<T> {
+        let mut slot = self.0.lock().expect("the service panicked while answering");
+        if let Some(value) = slot.value.take() {
+            return Poll::Ready(value);
+        }
+        assert!(
+            !slot.abandoned,
+            "the allocator service stopped before answering"
+        );
+        slot.waker = Some(cx.waker().clone());
+        Poll::Pending
+    }
+}
+
+fn pending<T>() -> (Completion<T>, Pending<T>) {
+    let slot = Arc::new(Mutex::new(Slot {
+        value: None,
+        waker: None,
+        abandoned: false,
+    }));
+    (Completion(slot.clone()), Pending(slot))
+}
+
+/// a running service; `&AllocService` can be shared across threads, and dropping it finishes the queued requests before the worker exits.
+pub struct AllocService<const N: usize = 5, W: Clone = FheUint64> {
+    requests: Option<Sender<Request<W>>>,
+    worker: Option<JoinHandle<CryptMalloc<N, W>>>,
+}
+
+impl<const N: usize, W: Clone> fmt::Debug for AllocService<N, W> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("AllocService")
+            .field("running", &self.requests.is_some())
+            .finish()
+    }
+}
+
+impl<const N: usize, W: PtrWord + 'static> AllocService<N, W> {
+    /// moves `allocator` onto a new worker thread that serves requests under `policy`; fails when the thread or the compute pool cannot be started.
+    pub fn spawn(allocator: CryptMalloc<N, W>, policy: BatchPolicy) -> io::Result<Self> {
+        let pool = rayon::ThreadPoolBuilder::new()
+            .num_threads(policy.threads)
+            .thread_name(|index| format!("cryptmalloc-compute-{index}"))
+            .build()
+            .map_err(io::Error::other)?;
+        let (requests, queue) = mpsc::channel();
+        let worker = thread::Builder::new()
+            .name("cryptmalloc-service".into())
+            .spawn(move || {
+                let mut allocator = allocator;
+                while let Some(batch) = next_batch(&queue, &policy) {
+                    pool.install(|| run_batch(&mut allocator, batch));
+                }
+                allocator
+            })?;
+        Ok(Self {
+            requests: Some(requests),
+            worker: Some(worker),
+        })
+    }
+
+    /// queues one allocation; the future yields what `CryptMalloc::allocate` would have.
+    pub fn allocate(&self, size: W) -> Pending<EncryptedOption<EncryptedPtr<W>>> {
+        let (completion, pending) = pending();
+        self.submit(Request::Allocate(size, completion));
+        pending
+    }
+
+    /// queues one free; the future resolves once the pointer's block is released.
+    pub fn free(&self, ptr: EncryptedPtr<W>) -> Pending<()> {
+        let (completion, pending) = pending();
+        self.submit(Request::Free(ptr, completion));
+        pending
+    }
+
+    /// stops accepting requests, finishes the queued ones and hands the allocator back.
+    pub fn shutdown(mut self) -> CryptMalloc<N, W> {
+        self.requests = None;
+        let worker = self.worker.take().expect("the worker is joined only once");
+        worker
+            .join()
+            .unwrap_or_else(|panic| std::panic::resume_unwind(panic))
+    }
+
+    fn submit(&self, request: Request<W>) {
+        if let Some(requests) = &self.requests {
+            // a stopped worker hands the request back inside the error, whose completion then marks the caller's slot abandoned.
+            let _ = requests.send(request);
+        }
+    }
+}
+
+impl<const N: usize, W: Clone> Drop for AllocService<N, W> {
+    fn drop(&mut self) {
+        self.requests = None;
+        if let Some(worker) = self.worker.take() {
+            let _ = worker.join();
+        }
+    }
+}
+
+/// blocks for a batch's first request, then collects more until the batch is full or its deadline passes; `None` once every sender is gone and the queue is empty.
+fn next_batch<W: Clone>(
+    queue: &Receiver<Request<W>>,
+    policy: &BatchPolicy,
+) -> Option<Vec<Request<W>>> {
+    let first = queue.recv().ok()?;
+    let deadline = Instant::now() + policy.max_delay;
+    let mut batch = vec![first];
+    while batch.len() < policy.max_batch {
+        let Some(wait) = deadline.checked_duration_since(Instant::now()) else {
+            break;
+        };
+        match queue.recv_timeout(wait) {
+            Ok(request) => batch.push(request),
+            Err(_) => break,
+        }
+    }
+    Some(batch)
+}
+
+/// releases the batch's frees first, so blocks freed in this batch can satisfy its allocations, then serves every allocation in arrival order.
+fn run_batch<const N: usize, W: PtrWord>(
+    allocator: &mut CryptMalloc<N, W>,
+    batch: Vec<Request<W>>,
+) {
+    let mut sizes = Vec::new();
+    let mut allocations = Vec::new();
+    let mut frees = Vec::new();
+    for request in batch {
+        match request {
+            Request::Allocate(size, completion) => {
+                sizes.push(size);
+                allocations.push(completion);
+            }
+            Request::Free(ptr, completion) => {
+                allocator.free_deferred(ptr);
+                frees.push(completion);
+            }
+        }
+    }
+
+    allocator.flush_frees();
+    for completion in frees {
+        completion.complete(());
+    }
+    if !sizes.is_empty() {
+        let results = allocator.allocate_many(&sizes);
+        for (completion, result) in allocations.into_iter().zip(results) {
+            completion.complete(result);
+        }
+    }
+}
@@ -0,0 +1,246 @@
+//! ShardedCryptMalloc runs several independent `CryptMalloc` instances side by side, one per shard, so requests on different shards never wait on each other.
+//! Shard `k` owns the public address range `k * span .. (k + 1) * span`, and every shard evaluates under the same server key through clones of one `Keys`.
+//! Which shard serves a request is chosen from a caller ID or the calling thread, both public; an encrypted pointer alone does not reveal its shard, so a cross-shard `free` runs every shard's constant-time free and only the owning range matches.
+//! Each shard computes on its own rayon pool, and its lock is only ever waited on by threads outside every pool: a rayon worker blocked on a shard could otherwise starve the lock holder of workers, or steal a second task for the same shard while it waits and lock it again.
+
+use crate::{
+    allocator::{slab_bytes, CryptMalloc, SIZE_CLASSES},
+    encrypted_option::EncryptedOption,
+    encrypted_ptr::EncryptedPtr,
+    keys::{Keys, TableConstruction},
+    word::{word_holds, PtrWord},
+};
+use core::fmt;
+use rayon::prelude::*;
+use std::{
+    collections::hash_map::DefaultHasher,
+    hash::{Hash, Hasher},
+    ops::Range,
+    panic,
+    sync::{Mutex, MutexGuard},
+    thread,
+};
+use tfhe::FheUint64;
+
+/// `N` tiers per shard on pointer word `W`, exactly as in `CryptMalloc`; shards are locked one at a time, so the pool is `Sync` and handles can be shared across threads.
+pub struct ShardedCryptMalloc<const N: usize = 5, W = FheUint64> {
+    keys: Keys,
+    shards: Vec<Shard<N, W>>,
+    span: u64,
+}
+
+/// one shard's allocator and the pool its operations compute on.
+struct Shard<const N: usize, W> {
+    allocator: Mutex<CryptMalloc<N, W>>,
+    pool: rayon::ThreadPool,
+}
+
+impl<const N: usize, W> fmt::Debug for ShardedCryptMalloc<N, W> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("ShardedCryptMalloc")
+            .field("shards", &self.shards.len())
+            .field("span", &self.span)
+            .finish()
+    }
+}
+
+impl ShardedCryptMalloc {
+    /// `shards` default five-tier allocators with fresh keys, each followed by an `arena_size`-byte arena.
+    pub fn new(shards: usize, arena_size: u64) -> Self {
+        Self::with_layout(
+            Keys::new(),
+            shards,
+            SIZE_CLASSES,
+            arena_size,
+            TableConstruction::default(),
+        )
+    }
+}
+
+impl<const N: usize, W: PtrWord> ShardedCryptMalloc<N, W> {
+    /// builds `shards` allocators over the same tier table, in parallel, laid out back to back; panics unless the pointer word represents the end of the last shard.
+    /// The current pool's threads are split evenly between the shards' compute pools, at least one each.
+    pub fn with_layout(
+        keys: Keys,
+        shards: usize,
+        tiers: [(usize, usize); N],
+        arena_size: u64,
+        construction: TableConstruction,
+    ) -> Self {
+        assert!(shards > 0, "a sharded pool needs at least one shard");
+        let span = slab_bytes(&tiers)
+            .and_then(|bytes| bytes.checked_add(arena_size))
+            .expect("a shard's layout overflows a 64-bit address space");
+        // overlapping shard ranges would let a cross-shard free match the wrong shard, so the whole pool must fit the word.
+        let pool_end = (shards as u64)
+            .checked_mul(span)
+            .expect("the shards overflow a 64-bit address space");
+        assert!(
+            word_holds(pool_end, W::BITS),
+            "{shards} shards of {span} bytes do not fit a {}-bit pointer word",
+            W::BITS
+        );
+
+        let threads = (rayon::current_num_threads() / shards).max(1);
+        let shards = (0..shards)
+            .into_par_iter()
+            .map(|shard| Shard {
+                allocator: Mutex::new(CryptMalloc::with_base(
+                    keys.clone(),
+                    tiers,
+                    shard as u64 * span,
+                    arena_size,
+                    construction,
+                )),
+                pool: rayon::ThreadPoolBuilder::new()
+                    .num_threads(threads)
+                    .thread_name(move |index| format!("cryptmalloc-shard-{shard}-{index}"))
+                    .build()
+                    .expect("cannot start a shard's compute pool"),
+            })
+            .collect();
+        Self { keys, shards, span }
+    }
+
+    pub fn shard_count(&self) -> usize {
+        self.shards.len()
+    }
+
+    /// bytes of address space each shard owns.
+    pub fn shard_span(&self) -> u64 {
+        self.span
+    }
+
+    /// the public address range of one shard.
+    pub fn shard_range(&self, shard: usize) -> Range<u64> {
+        let start = shard as u64 * self.span;
+        start..start + self.span
+    }
+
+    /// the shard a caller ID maps to.
+    pub fn shard_for(&self, caller: u64) -> usize {
+        (caller % self.shards.len() as u64) as usize
+    }
+
+    /// a handle serving `caller` from its shard; equal IDs always share a shard.
+    pub fn handle(&self, caller: u64) -> ShardHandle<'_, N, W> {
+        ShardHandle {
+            pool: self,
+            shard: self.shard_for(caller),
+        }
+    }
+
+    /// a handle for the calling thread, keyed by a hash of its `ThreadId`.
+    pub fn thread_handle(&self) -> ShardHandle<'_, N, W> {
+        let mut hasher = DefaultHasher::new();
+        thread::current().id().hash(&mut hasher);
+        self.handle(hasher.finish())
+    }
+
+    /// exclusive access to one shard, e.g. to change its routing or selection settings; work run through the guard computes on the caller's pool, so allocate through a `ShardHandle` instead.
+    pub fn lock_shard(&self, shard: usize) -> MutexGuard<'_, CryptMalloc<N, W>> {
+        self.shards[shard]
+            .allocator
+            .lock()
+            .expect("a shard panicked mid-operation")
+    }
+
+    /// frees a pointer whose shard the caller does not know: every shard runs its constant-time free in parallel, and all but the owner leave their state unchanged.
+    /// Costs one free per shard; `ShardHandle::free` touches only its own shard.
+    pub fn free(&self, ptr: &EncryptedPtr<W>) {
+        self.each_shard(|allocator| allocator.free(ptr));
+    }
+
+    /// releases every shard's queued frees, the shards in parallel.
+    pub fn flush_frees(&self) {
+        self.each_shard(CryptMalloc::flush_frees);
+    }
+
+    pub fn keys(&self) -> &Keys {
+        &self.keys
+    }
+
+    /// runs `op` on one shard under its lock and inside its pool; a rayon worker hands the call to a scoped thread, which blocks on the lock and the pool without stealing other tasks.
+    fn run<R: Send>(&self, shard: usize, op: impl FnOnce(&mut CryptMalloc<N, W>) -> R + Send) -> R {
+        let locked = || {
+            let mut guard = self.lock_shard(shard);
+            let allocator = &mut *guard;
+            self.shards[shard].pool.install(|| op(allocator))
+        };
+        if rayon::current_thread_index().is_none() {
+            return locked();
+        }
+        thread::scope(|scope| {
+            scope
+                .spawn(locked)
+                .join()
+                .unwrap_or_else(|panic| panic::resume_unwind(panic))
+        })
+    }
+
+    /// runs `op` on every shard at once, one scoped thread per shard.
+    fn each_shard(&self, op: impl Fn(&mut CryptMalloc<N, W>) + Sync) {
+        let op = &op;
+        thread::scope(|scope| {
+            let workers: Vec<_> = (0..self.shards.len())
+                .map(|shard| scope.spawn(move || self.run(shard, op)))
+                .collect();
+            for worker in workers {
+                worker
+                    .join()
+                    .unwrap_or_else(|panic| panic::resume_unwind(panic));
+            }
+        });
+    }
+}
+
+/// a `Copy` view of one shard; requests through it lock only that shard, so handles on different shards run concurrently.
+pub struct ShardHandle<'a, const N: usize = 5, W = FheUint64> {
+    pool: &'a ShardedCryptMalloc<N, W>,
+    shard: usize,
+}
+
+impl<const N: usize, W> Clone for ShardHandle<'_, N, W> {
+    fn clone(&self) -> Self {
+        *self
+    }
+}
+
+impl<const N: usize, W> Copy for ShardHandle<'_, N, W> {}
+
+impl<const N: usize, W> fmt::Debug for ShardHandle<'_, N, W> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("ShardHandle")
+            .field("shard", &self.shard)
+            .finish()
+    }
+}
+
+impl<const N: usize, W: PtrWord> ShardHandle<'_, N, W> {
+    pub fn shard(&self) -> usize {
+        self.shard
+    }
+
+    /// `CryptMalloc::allocate` on this handle's shard.
+    pub fn allocate(&self, size: W) -> EncryptedOption<EncryptedPtr<W>> {
+        self.pool
+            .run(self.shard, |allocator| allocator.allocate(size))
+    }
+
+    /// `CryptMalloc::allocate_many` on this handle's shard.
+    pub fn allocate_many(&self, sizes: &[W]) -> Vec<EncryptedOption<EncryptedPtr<W>>> {
+        self.pool
+            .run(self.shard, |allocator| allocator.allocate_many(sizes))
+    }
+
+    /// frees a pointer this shard handed out; pointers from other shards are constant-time no-ops here, so free those through `ShardedCryptMalloc::free`.
+    pub fn free(&self, ptr: &EncryptedPtr<W>) {
+        self.pool.run(self.shard, |allocator| allocator.free(ptr));
+    }
+
+    /// `CryptMalloc::free_deferred` on this handle's shard.
+    pub fn free_deferred(&self, ptr: EncryptedPtr<W>) {
+        self.pool
+            .run(self.shard, |allocator| allocator.free_deferred(ptr));
+    }
+}
@@ -1,52 +1,133 @@
 //! SlabClass models a fixed block allocator tier; `bitmap[i] = enc_true` marks an allocated block and `enc_false` marks free, so the canonical invariant stays purely encrypted.
-//! Block sizing metadata remains plaintext, but every allocation decision uses the injected server key plus pre-encrypted index/offset tables supplied by the caller.
+//! Block sizing metadata and the tier base address remain plaintext and enter the circuit only as scalar operands, while every allocation decision uses the injected server key plus pre-encrypted offset tables supplied by the caller.
 
-use crate::{encrypted_option::EncryptedOption, encrypted_ptr::EncryptedPtr};
+use crate::{
+    encrypted_option::EncryptedOption,
+    encrypted_ptr::EncryptedPtr,
+    keys::{invalid_data, KeyContext},
+    packed::{BitmapLayout, PackedBitmap, FLAGS_PER_WORD},
+    scan::{
+        first_set, inclusive_prefix_or, inclusive_scan, one_hot_select, one_hot_select_by,
+        SelectionMode,
+    },
+    snapshot::{SnapshotReader, SnapshotWriter},
+    word::PtrWord,
+};
 use core::fmt;
-use std::ops::Not;
-use tfhe::{prelude::*, set_server_key, FheBool, FheUint32, FheUint64, ServerKey};
+use rayon::prelude::*;
+use std::{
+    borrow::Cow,
+    io::{self, Read, Write},
+};
+use tfhe::{prelude::*, FheBool, FheUint16, FheUint32, FheUint64};
 
+/// controls whether a slab keeps `base_offset + enc_offsets_u64[i]` resident; caching trades one extra ciphertext per block for skipping that 64-bit addition on every scan.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum AddressCache {
+    /// rebuild every absolute address inside each scan; no extra ciphertext memory.
+    Recompute,
+    /// build the absolute table on the first scan that needs it and keep it.
+    #[default]
+    Lazy,
+    /// build the absolute table as soon as the policy is applied.
+    Eager,
+}
+
+/// chooses how `free` recognises the block a pointer refers to; both strategies scan every cell once and leave foreign pointers as no-ops.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub enum FreeStrategy {
+    /// 64-bit ciphertext equality between the pointer and each block address.
+    AddressEquality,
+    /// one decode of the pointer into a 16-bit block index, then a scalar 16-bit equality per cell.
+    #[default]
+    IndexDecode,
+}
+
+/// an allocation whose pointer is known but whose bits are not written yet; `write_claim` applies it, optionally together with a release.
+pub(crate) struct Claim {
+    bits: ClaimBits,
+    groups: Option<Vec<FheBool>>,
+}
+
+enum ClaimBits {
+    /// one flag per block, set on the claimed cell only.
+    Flags(Vec<FheBool>),
+    /// one mask per packed word, holding the claimed bit.
+    Packed(Vec<FheUint64>),
+}
+
+/// a pointer decoded once for a release folded into `write_claim`: its block index when the tier decodes pointers, one address match per block otherwise.
+pub(crate) struct Release<W> {
+    in_tier: FheBool,
+    matches: ReleaseMatches<W>,
+}
+
+enum ReleaseMatches<W> {
+    Index(W),
+    Address(Vec<FheBool>),
+}
+
+impl<W> Release<W> {
+    /// holds when the pointer is one of this tier's blocks (for address matching: lies in the tier's range).
+    pub(crate) fn in_tier(&self) -> &FheBool {
+        &self.in_tier
+    }
+}
+
+/// `W` is the pointer word every address, offset and pointer comparison uses; `FheUint64` unless the heap is small enough for a narrower one.
 #[derive(Clone)]
-pub struct SlabClass {
+pub struct SlabClass<W = FheUint64> {
     block_size: usize,
     num_blocks: usize,
     bitmap: Vec<FheBool>,
-    base_offset: FheUint64,
-    server_key: ServerKey,
+    base_offset: u64,
+    context: KeyContext,
     enc_false: FheBool,
     enc_true: FheBool,
     enc_zero_u32: FheUint32,
-    enc_zero_u64: FheUint64,
-    enc_indices_u32: Vec<FheUint32>,
-    enc_offsets_u64: Vec<FheUint64>,
+    enc_zero_u64: W,
+    enc_offsets_u64: Vec<W>,
+    selection_mode: SelectionMode,
+    address_cache: AddressCache,
+    enc_addresses_u64: Option<Vec<W>>,
+    free_strategy: FreeStrategy,
+    packed: Option<PackedBitmap>,
+    group_free: Option<Vec<FheBool>>,
 }
 
-impl fmt::Debug for SlabClass {
+impl<W: PtrWord> fmt::Debug for SlabClass<W> {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         f.debug_struct("SlabClass")
             .field("block_size", &self.block_size)
             .field("num_blocks", &self.num_blocks)
             .field("bitmap_len", &self.bitmap.len())
-            .field("base_offset", &"<ciphertext>")
+            .field("base_offset", &self.base_offset)
+            .field("selection_mode", &self.selection_mode)
+            .field("address_cache", &self.address_cache)
+            .field("addresses_cached", &self.enc_addresses_u64.is_some())
+            .field("free_strategy", &self.free_strategy)
+            .field("bitmap_layout", &self.bitmap_layout())
+            .field(
+                "group_width",
+                &self.group_free.as_ref().map(|_| self.group_width()),
+            )
             .finish()
     }
 }
 
-impl SlabClass {
+impl<W: PtrWord> SlabClass<W> {
     #[allow(clippy::too_many_arguments)]
     pub fn new(
         block_size: usize,
         num_blocks: usize,
-        base_offset: FheUint64,
-        server_key: ServerKey,
+        base_offset: u64,
+        context: KeyContext,
         enc_false: FheBool,
         enc_true: FheBool,
         enc_zero_u32: FheUint32,
-        enc_zero_u64: FheUint64,
-        enc_indices_u32: Vec<FheUint32>,
-        enc_offsets_u64: Vec<FheUint64>,
+        enc_zero_u64: W,
+        enc_offsets_u64: Vec<W>,
     ) -> Self {
-        set_server_key(server_key.clone());
         let mut bitmap = Vec::with_capacity(num_blocks);
         for _ in 0..num_blocks {
             bitmap.push(enc_false.clone());
@@ -57,113 +138,995 @@ impl SlabClass {
             num_blocks,
             bitmap,
             base_offset,
-            server_key,
+            context,
             enc_false,
             enc_true,
             enc_zero_u32,
             enc_zero_u64,
-            enc_indices_u32,
             enc_offsets_u64,
+            selection_mode: SelectionMode::default(),
+            address_cache: AddressCache::default(),
+            enc_addresses_u64: None,
+            free_strategy: FreeStrategy::default(),
+            packed: None,
+            group_free: None,
         }
     }
 
+    pub fn selection_mode(&self) -> SelectionMode {
+        self.selection_mode
+    }
+
+    /// switches the first-free search strategy; the mode is public configuration and every strategy touches every block.
+    /// `Grouped` builds its per-group summary here and drops it again when another mode is chosen.
+    pub fn set_selection_mode(&mut self, mode: SelectionMode) {
+        self.selection_mode = mode;
+        let _guard = self.context.enter();
+        self.sync_groups();
+    }
+
+    /// blocks per group under `SelectionMode::Grouped`: the power of two nearest above sqrt(num_blocks).
+    pub fn group_width(&self) -> usize {
+        let width = (self.num_blocks as f64).sqrt().ceil() as usize;
+        width.max(1).next_power_of_two()
+    }
+
+    /// encrypted "group has a free block" flags, present while `Grouped` selection runs on the flag layout.
+    pub fn group_summary(&self) -> Option<&[FheBool]> {
+        self.group_free.as_deref()
+    }
+
+    /// builds or drops the group summary so it exists exactly when `Grouped` selection runs on the flag layout.
+    fn sync_groups(&mut self) {
+        let wanted = self.selection_mode == SelectionMode::Grouped && self.packed.is_none();
+        self.group_free = wanted.then(|| self.build_groups());
+    }
+
+    /// recomputes the summary after a bitmap update that did not go through the grouped scan.
+    fn refresh_groups(&mut self) {
+        if self.group_free.is_some() {
+            self.group_free = Some(self.build_groups());
+        }
+    }
+
+    fn build_groups(&self) -> Vec<FheBool> {
+        let context = &self.context;
+        self.bitmap
+            .par_chunks(self.group_width())
+            .map(|group| {
+                context.install();
+                or_all(
+                    group.iter().map(|is_allocated| !is_allocated),
+                    &self.enc_false,
+                )
+            })
+            .collect()
+    }
+
     pub fn block_size(&self) -> usize {
-        set_server_key(self.server_key.clone());
         self.block_size
     }
 
+    /// blocks materialized so far; a tier built for lazy growth starts below its reserved count and gains blocks through `grow`.
     pub fn num_blocks(&self) -> usize {
-        set_server_key(self.server_key.clone());
         self.num_blocks
     }
 
+    /// appends one free block per entry of `offsets`, which continue the offset table; when to grow is the caller's call and must follow from public configuration only.
+    /// Every resident table grows along: cached addresses, the packed words and the group summary, whose width may change with the new block count.
+    pub fn grow(&mut self, offsets: Vec<W>) {
+        if offsets.is_empty() {
+            return;
+        }
+        let _guard = self.context.enter();
+        let context = &self.context;
+        let added = offsets.len();
+        if let Some(addresses) = self.enc_addresses_u64.as_mut() {
+            let base_offset = self.base_offset;
+            let added_addresses: Vec<W> = offsets
+                .par_iter()
+                .map(|offset| {
+                    context.install();
+                    offset.scalar_add(base_offset)
+                })
+                .collect();
+            addresses.extend(added_addresses);
+        }
+        self.enc_offsets_u64.extend(offsets);
+
+        let was_packed = self.packed.is_some();
+        let mut flags = match self.packed.take() {
+            Some(packed) => packed.to_flags(context),
+            None => core::mem::take(&mut self.bitmap),
+        };
+        flags.resize(flags.len() + added, self.enc_false.clone());
+        self.num_blocks += added;
+        // a packed tier stays packed unless it outgrew the 16-bit index decode.
+        if was_packed && self.decode_shift().is_some() {
+            self.packed = Some(PackedBitmap::from_flags(&flags, context));
+        } else {
+            self.bitmap = flags;
+        }
+        self.sync_groups();
+    }
+
+    /// per-block flags under `BitmapLayout::Flags`; empty while the packed layout owns the occupancy bits.
     pub fn bitmap(&self) -> &[FheBool] {
-        set_server_key(self.server_key.clone());
         &self.bitmap
     }
 
-    pub fn base_offset(&self) -> &FheUint64 {
-        set_server_key(self.server_key.clone());
-        &self.base_offset
+    pub fn packed_bitmap(&self) -> Option<&PackedBitmap> {
+        self.packed.as_ref()
+    }
+
+    pub fn bitmap_layout(&self) -> BitmapLayout {
+        match self.packed {
+            Some(_) => BitmapLayout::Packed,
+            None => BitmapLayout::Flags,
+        }
+    }
+
+    /// converts the occupancy bits between layouts without changing which blocks are allocated; `Packed` is ignored for tiers whose pointers cannot be decoded to a bit position.
+    pub fn set_bitmap_layout(&mut self, layout: BitmapLayout) {
+        let _guard = self.context.enter();
+        match (layout, self.packed.take()) {
+            (BitmapLayout::Flags, Some(packed)) => self.bitmap = packed.to_flags(&self.context),
+            (BitmapLayout::Packed, None) if self.decode_shift().is_some() => {
+                self.packed = Some(PackedBitmap::from_flags(&self.bitmap, &self.context));
+                self.bitmap = Vec::new();
+            }
+            (_, current) => self.packed = current,
+        }
+        self.sync_groups();
+    }
+
+    /// encrypted count of free blocks, computed by popcount on packed words or by summing negated flags.
+    pub fn free_count(&self) -> FheUint32 {
+        let _guard = self.context.enter();
+        let context = &self.context;
+        if let Some(packed) = &self.packed {
+            return packed.count_free(&self.enc_zero_u32, context);
+        }
+        self.bitmap
+            .par_iter()
+            .map(|is_allocated| {
+                context.install();
+                FheUint32::cast_from(!is_allocated)
+            })
+            .reduce_with(|left, right| {
+                context.install();
+                left + right
+            })
+            .unwrap_or_else(|| self.enc_zero_u32.clone())
+    }
+
+    pub fn base_offset(&self) -> u64 {
+        self.base_offset
     }
 
     pub fn enc_false(&self) -> &FheBool {
-        set_server_key(self.server_key.clone());
         &self.enc_false
     }
 
     pub fn enc_true(&self) -> &FheBool {
-        set_server_key(self.server_key.clone());
         &self.enc_true
     }
 
     pub fn enc_zero_u32(&self) -> &FheUint32 {
-        set_server_key(self.server_key.clone());
         &self.enc_zero_u32
     }
 
-    pub fn enc_zero_u64(&self) -> &FheUint64 {
-        set_server_key(self.server_key.clone());
+    pub fn enc_zero_u64(&self) -> &W {
         &self.enc_zero_u64
     }
 
-    pub fn enc_indices_u32(&self) -> &[FheUint32] {
-        set_server_key(self.server_key.clone());
-        &self.enc_indices_u32
+    pub fn enc_offsets_u64(&self) -> &[W] {
+        &self.enc_offsets_u64
     }
 
-    pub fn enc_offsets_u64(&self) -> &[FheUint64] {
-        set_server_key(self.server_key.clone());
-        &self.enc_offsets_u64
+    pub fn address_cache(&self) -> AddressCache {
+        self.address_cache
+    }
+
+    /// applies a caching policy; `Eager` builds the table now, `Recompute` drops any table already held.
+    pub fn set_address_cache(&mut self, policy: AddressCache) {
+        self.address_cache = policy;
+        match policy {
+            AddressCache::Recompute => self.enc_addresses_u64 = None,
+            AddressCache::Lazy => {}
+            AddressCache::Eager => {
+                let _guard = self.context.enter();
+                self.prepare_addresses();
+            }
+        }
+    }
+
+    /// absolute block addresses when cached; `None` under `Recompute` or before the first lazy scan.
+    pub fn enc_addresses_u64(&self) -> Option<&[W]> {
+        self.enc_addresses_u64.as_deref()
+    }
+
+    fn prepare_addresses(&mut self) {
+        if self.address_cache != AddressCache::Recompute && self.enc_addresses_u64.is_none() {
+            self.enc_addresses_u64 = Some(self.build_addresses());
+        }
+    }
+
+    fn build_addresses(&self) -> Vec<W> {
+        let context = &self.context;
+        self.enc_offsets_u64
+            .par_iter()
+            .map(|offset| {
+                context.install();
+                offset.scalar_add(self.base_offset)
+            })
+            .collect()
+    }
+
+    fn block_address(&self, idx: usize) -> Cow<'_, W> {
+        match &self.enc_addresses_u64 {
+            Some(table) => Cow::Borrowed(&table[idx]),
+            None => Cow::Owned(self.enc_offsets_u64[idx].scalar_add(self.base_offset)),
+        }
+    }
+
+    fn block_addresses(&self) -> Cow<'_, [W]> {
+        match &self.enc_addresses_u64 {
+            Some(table) => Cow::Borrowed(table.as_slice()),
+            None => Cow::Owned(self.build_addresses()),
+        }
+    }
+
+    /// Performs the constant-time masked allocation scan described in Spec 3.2; `requested_mask` is a one-hot selector from the routing layer, every block is scanned and written back once, so no early exits occur.
+    pub fn allocate_masked(
+        &mut self,
+        requested_mask: &FheBool,
+    ) -> EncryptedOption<EncryptedPtr<W>> {
+        let (result, claim) = self.claim_masked(requested_mask);
+        self.write_claim(claim, None);
+        result
     }
 
-    /// Performs the constant-time masked allocation scan described in Spec 3.2; `requested_mask` is a one-hot selector from the routing layer, every block is scanned, and write-back runs a second full pass so no early exits occur.
-    pub fn allocate_masked(&mut self, requested_mask: FheBool) -> EncryptedOption<EncryptedPtr> {
-        set_server_key(self.server_key.clone());
+    /// the allocation `allocate_masked` would make, with its bitmap write left to `write_claim`.
+    pub(crate) fn claim_masked(
+        &mut self,
+        requested_mask: &FheBool,
+    ) -> (EncryptedOption<EncryptedPtr<W>>, Claim) {
+        let _guard = self.context.enter();
+
+        let shift = self.decode_shift();
+        if let (Some(packed), Some(shift)) = (self.packed.as_ref(), shift) {
+            let (value, is_some, set) = packed.claim_first_free(
+                requested_mask,
+                self.base_offset,
+                shift,
+                &self.enc_zero_u64,
+                &self.enc_false,
+                &self.context,
+            );
+            let result = EncryptedOption {
+                value: EncryptedPtr::new(value),
+                is_some,
+            };
+            let claim = Claim {
+                bits: ClaimBits::Packed(set),
+                groups: None,
+            };
+            return (result, claim);
+        }
+
+        self.prepare_addresses();
+        match self.selection_mode {
+            SelectionMode::Linear => self.claim_linear(requested_mask),
+            SelectionMode::PrefixOr => self.claim_prefix(requested_mask),
+            SelectionMode::Grouped => self.claim_grouped(requested_mask),
+        }
+    }
+
+    /// decodes `ptr` once for a release that `write_claim` folds into the next write-back; dispatches like `free`.
+    pub(crate) fn locate_release(&mut self, ptr: &EncryptedPtr<W>) -> Release<W> {
+        let _guard = self.context.enter();
+        match self.decode_shift() {
+            Some(shift)
+                if self.packed.is_some() || self.free_strategy == FreeStrategy::IndexDecode =>
+            {
+                let (block_index, valid) = self.decode_pointer(ptr, shift);
+                Release {
+                    in_tier: valid,
+                    matches: ReleaseMatches::Index(block_index),
+                }
+            }
+            _ => {
+                self.prepare_addresses();
+                let context = &self.context;
+                let matches: Vec<FheBool> = (0..self.num_blocks)
+                    .into_par_iter()
+                    .map(|i| {
+                        context.install();
+                        self.block_address(i).eq(&ptr.0)
+                    })
+                    .collect();
+                // a pointer is in the tier only when it names a block; `contains` alone would accept a misaligned address inside the range.
+                Release {
+                    in_tier: or_all(matches.iter().cloned(), &self.enc_false),
+                    matches: ReleaseMatches::Address(matches),
+                }
+            }
+        }
+    }
 
+    /// writes `claim` back and, when `release` is given, frees its block under the condition in the same pass: every cell becomes `(cell | claimed) & !(released & condition)`, and a group summary takes the claim's value or-ed with its released blocks.
+    pub(crate) fn write_claim(&mut self, claim: Claim, release: Option<(&Release<W>, &FheBool)>) {
+        let _guard = self.context.enter();
+        let context = &self.context;
+        let fires =
+            release.map(|(release, condition)| (&release.matches, &release.in_tier & condition));
+
+        let set = match claim.bits {
+            ClaimBits::Packed(set) => {
+                let clear = match fires {
+                    // a packed tier always decodes its pointers, so its releases are indices.
+                    Some((ReleaseMatches::Index(block_index), fires)) => {
+                        vec![(block_index.to_u64(), fires)]
+                    }
+                    _ => Vec::new(),
+                };
+                if let Some(packed) = self.packed.as_mut() {
+                    packed.update(Some(&set), &clear, context);
+                }
+                return;
+            }
+            ClaimBits::Flags(set) => set,
+        };
+
+        let released: Vec<FheBool> = match fires {
+            Some((ReleaseMatches::Index(block_index), fires)) => {
+                let index = block_index.to_u16();
+                (0..self.num_blocks)
+                    .into_par_iter()
+                    .map(|i| {
+                        context.install();
+                        index.eq(i as u16) & &fires
+                    })
+                    .collect()
+            }
+            Some((ReleaseMatches::Address(matches), fires)) => matches
+                .par_iter()
+                .map(|matched| {
+                    context.install();
+                    matched & &fires
+                })
+                .collect(),
+            None => Vec::new(),
+        };
+
+        let mut groups = claim.groups;
+        if let (Some(groups), false) = (groups.as_mut(), released.is_empty()) {
+            let enc_false = &self.enc_false;
+            groups
+                .par_iter_mut()
+                .zip(released.par_chunks(self.group_width()))
+                .for_each(|(summary, released)| {
+                    context.install();
+                    *summary |= or_all(released.iter().cloned(), enc_false);
+                });
+        }
+        if groups.is_some() {
+            self.group_free = groups;
+        }
+
+        self.bitmap
+            .par_iter_mut()
+            .zip(set.par_iter())
+            .enumerate()
+            .for_each(|(i, (cell, claimed))| {
+                context.install();
+                *cell |= claimed;
+                if let Some(released) = released.get(i) {
+                    *cell &= !released;
+                }
+            });
+    }
+
+    /// sequential scan: `should_sel` is one-hot across the loop, so it is the claimed cell flag as is.
+    /// Operands are borrowed throughout and the running flag is updated in place, so each block costs the new `should_sel` flag and the pointer mux and nothing else.
+    fn claim_linear(&self, requested_mask: &FheBool) -> (EncryptedOption<EncryptedPtr<W>>, Claim) {
         let mut selected = self.enc_false.clone();
-        let mut selected_index = self.enc_zero_u32.clone();
         let mut selected_ptrval = self.enc_zero_u64.clone();
+        let mut claimed = Vec::with_capacity(self.num_blocks);
 
         for i in 0..self.num_blocks {
-            let is_allocated = self.bitmap[i].clone();
-            let is_free = is_allocated.not();
-            let not_selected = selected.clone().not();
-            let can_select = (&is_free) & (&not_selected);
-            let should_sel = (&can_select) & (&requested_mask);
-            let candidate = &self.base_offset + &self.enc_offsets_u64[i];
+            let should_sel = !&self.bitmap[i] & !&selected & requested_mask;
+            let candidate = self.block_address(i);
 
-            selected_ptrval = should_sel.if_then_else(&candidate, &selected_ptrval);
-            selected_index = should_sel.if_then_else(&self.enc_indices_u32[i], &selected_index);
-            selected = (&selected) | (&should_sel);
+            selected_ptrval = W::select(&should_sel, &candidate, &selected_ptrval);
+            selected |= &should_sel;
+            claimed.push(should_sel);
         }
 
-        let selected_mask = (&selected) & (&requested_mask);
+        let result = EncryptedOption {
+            value: EncryptedPtr::new(selected_ptrval),
+            is_some: selected,
+        };
+        let claim = Claim {
+            bits: ClaimBits::Flags(claimed),
+            groups: None,
+        };
+        (result, claim)
+    }
 
-        for j in 0..self.num_blocks {
-            let is_target = self.enc_indices_u32[j].eq(&selected_index);
-            let should_mark = (&is_target) & (&selected_mask);
-            let current = self.bitmap[j].clone();
-            let updated = should_mark.if_then_else(&self.enc_true, &current);
-            self.bitmap[j] = updated;
-        }
+    /// log-depth variant of the scan: `seen_free[i]` is the prefix-OR of the free flags, so block `i` is the first free one exactly when it is free and `seen_free[i - 1]` is not.
+    /// The one-hot selectors feed both the pointer mux tree and the claim, so no index comparison pass is needed.
+    /// The free flags are negated straight into the scan buffer and re-derived from the bitmap where needed, so no copy of them is kept.
+    fn claim_prefix(&self, requested_mask: &FheBool) -> (EncryptedOption<EncryptedPtr<W>>, Claim) {
+        let context = &self.context;
+
+        let mut seen_free: Vec<FheBool> = self
+            .bitmap
+            .par_iter()
+            .map(|is_allocated| {
+                context.install();
+                !is_allocated
+            })
+            .collect();
+        inclusive_prefix_or(&mut seen_free, context);
+
+        let should_sel: Vec<FheBool> = (0..self.num_blocks)
+            .into_par_iter()
+            .map(|i| {
+                context.install();
+                let is_free = !&self.bitmap[i];
+                match i {
+                    0 => is_free & requested_mask,
+                    _ => is_free & !&seen_free[i - 1] & requested_mask,
+                }
+            })
+            .collect();
 
-        EncryptedOption {
+        let candidates = self.block_addresses();
+        let selected_ptrval = one_hot_select(&should_sel, &candidates, &self.enc_zero_u64, context);
+
+        let selected_mask = match seen_free.last() {
+            Some(any_free) => any_free & requested_mask,
+            None => self.enc_false.clone(),
+        };
+
+        let result = EncryptedOption {
             value: EncryptedPtr::new(selected_ptrval),
             is_some: selected_mask,
+        };
+        let claim = Claim {
+            bits: ClaimBits::Flags(should_sel),
+            groups: None,
+        };
+        (result, claim)
+    }
+
+    /// two-level scan: the first group whose summary flag is set is selected, its free flags are gathered into one `group_width`-long vector by an OR over the groups, and a prefix-OR picks the block inside it.
+    /// Every cell is read once by the gather and claimed by one AND of its group and in-group selectors, and the pointer is the selected group's base plus the selected in-group offset, so no mux chain is longer than a group.
+    fn claim_grouped(
+        &mut self,
+        requested_mask: &FheBool,
+    ) -> (EncryptedOption<EncryptedPtr<W>>, Claim) {
+        let mut groups = self
+            .group_free
+            .take()
+            .unwrap_or_else(|| self.build_groups());
+        let context = &self.context;
+        let width = self.group_width();
+
+        let (first_group, any_free) = first_set(&groups, context);
+        let group_sel: Vec<FheBool> = first_group
+            .par_iter()
+            .map(|first| {
+                context.install();
+                first & requested_mask
+            })
+            .collect();
+
+        let local_free: Vec<FheBool> = (0..width.min(self.num_blocks))
+            .into_par_iter()
+            .map(|j| {
+                context.install();
+                let members = self
+                    .bitmap
+                    .iter()
+                    .skip(j)
+                    .step_by(width)
+                    .zip(group_sel.iter())
+                    .map(|(is_allocated, selected)| selected & !is_allocated);
+                or_all(members, &self.enc_false)
+            })
+            .collect();
+        let (local_sel, _) = first_set(&local_free, context);
+
+        let (group_base, local_offset) = {
+            let addresses = self.block_addresses();
+            rayon::join(
+                || {
+                    context.install();
+                    one_hot_select_by(
+                        &group_sel,
+                        |group| &addresses[group * width],
+                        &self.enc_zero_u64,
+                        context,
+                    )
+                },
+                || {
+                    context.install();
+                    one_hot_select(
+                        &local_sel,
+                        &self.enc_offsets_u64[..local_sel.len()],
+                        &self.enc_zero_u64,
+                        context,
+                    )
+                },
+            )
+        };
+
+        let still_free = or_all(
+            local_free
+                .iter()
+                .zip(local_sel.iter())
+                .map(|(free, taken)| free & !taken),
+            &self.enc_false,
+        );
+        groups
+            .par_iter_mut()
+            .zip(group_sel.par_iter())
+            .for_each(|(summary, selected)| {
+                context.install();
+                *summary = selected.if_then_else(&still_free, summary);
+            });
+
+        let claimed = (0..self.num_blocks)
+            .into_par_iter()
+            .map(|i| {
+                context.install();
+                &group_sel[i / width] & &local_sel[i % width]
+            })
+            .collect();
+
+        let is_some = match any_free {
+            Some(any_free) => any_free & requested_mask,
+            None => self.enc_false.clone(),
+        };
+        let result = EncryptedOption {
+            value: EncryptedPtr::new(group_base.add(&local_offset)),
+            is_some,
+        };
+        let claim = Claim {
+            bits: ClaimBits::Flags(claimed),
+            groups: Some(groups),
+        };
+        (result, claim)
+    }
+
+    /// serves a whole batch of routed requests with one compaction and one write-back; `masks[r]` says whether request `r` targets this tier.
+    /// Request `r` with inclusive rank `k` among this tier's requests receives the `k`-th free block; block `i` becomes allocated when it is free and its free count does not exceed the tier's total demand.
+    /// The free blocks' addresses move to the front once, at about `N log N` 16-bit muxes plus `N log² N / 2` boolean muxes for `N` blocks whatever the batch size, and each request then picks its slot among the first `B`; the packed layout, and sizes beyond 16-bit counters, fall back to one masked scan per request.
+    pub fn allocate_batch(&mut self, masks: &[FheBool]) -> Vec<EncryptedOption<EncryptedPtr<W>>> {
+        let _guard = self.context.enter();
+
+        if self.num_blocks == 0 {
+            // a tier with nothing materialized yet, e.g. under `TierGrowth::Chunked`, serves no request.
+            return masks
+                .iter()
+                .map(|_| {
+                    EncryptedOption::none(
+                        EncryptedPtr::new(self.enc_zero_u64.clone()),
+                        self.enc_false.clone(),
+                    )
+                })
+                .collect();
+        }
+        let counters_fit =
+            self.num_blocks < usize::from(u16::MAX) && masks.len() < usize::from(u16::MAX);
+        if self.packed.is_some() || !counters_fit {
+            return masks
+                .iter()
+                .map(|mask| self.allocate_masked(mask))
+                .collect();
+        }
+        if masks.is_empty() {
+            return Vec::new();
+        }
+
+        let context = &self.context;
+
+        let is_free: Vec<FheBool> = self
+            .bitmap
+            .par_iter()
+            .map(|is_allocated| {
+                context.install();
+                !is_allocated
+            })
+            .collect();
+        let mut free_rank: Vec<FheUint16> = is_free
+            .par_iter()
+            .map(|free| {
+                context.install();
+                FheUint16::cast_from(free.clone())
+            })
+            .collect();
+        inclusive_scan(&mut free_rank, |left, right| left + right, context);
+
+        let mut request_rank: Vec<FheUint16> = masks
+            .par_iter()
+            .map(|mask| {
+                context.install();
+                FheUint16::cast_from(mask.clone())
+            })
+            .collect();
+        inclusive_scan(&mut request_rank, |left, right| left + right, context);
+
+        let (results, demand) = {
+            let nth_free = self.compact_free(&is_free, &free_rank, masks.len());
+
+            let total_free = &free_rank[self.num_blocks - 1];
+            let results: Vec<EncryptedOption<EncryptedPtr<W>>> = masks
+                .par_iter()
+                .zip(request_rank.par_iter())
+                .map(|(mask, rank)| {
+                    context.install();
+                    let is_some = rank.le(total_free) & mask;
+                    let selectors: Vec<FheBool> = (1..=nth_free.len())
+                        .map(|position| rank.eq(position as u16) & &is_some)
+                        .collect();
+                    let value = one_hot_select(&selectors, &nth_free, &self.enc_zero_u64, context);
+                    EncryptedOption {
+                        value: EncryptedPtr::new(value),
+                        is_some,
+                    }
+                })
+                .collect();
+            (results, &request_rank[masks.len() - 1])
+        };
+
+        self.bitmap
+            .par_iter_mut()
+            .zip(is_free.par_iter().zip(free_rank.par_iter()))
+            .for_each(|(cell, (free, count))| {
+                context.install();
+                let claimed = free & count.le(demand);
+                *cell |= claimed;
+            });
+        self.refresh_groups();
+
+        results
+    }
+
+    /// the addresses of the first `slots` free blocks in block order, moved to the front by an order-preserving compaction network; slots past the free count hold arbitrary addresses.
+    /// Free block `i` sits `i + 1 - free_rank[i]` places past its slot, and level `l` shifts every free block whose remaining distance has bit `l` set by `2^l` places; taking the bits lowest first never lands two free blocks on one position, so a level is one index mux per position.
+    /// Each position also muxes the distance bits it has not consumed yet, `log N - l - 1` of them at level `l`, so the whole network costs `N log N` 16-bit muxes plus about `N log² N / 2` boolean ones.
+    /// The network carries 16-bit block indices rather than full pointer words, and only the `slots` it hands back are turned into addresses.
+    fn compact_free(&self, is_free: &[FheBool], free_rank: &[FheUint16], slots: usize) -> Vec<W> {
+        let context = &self.context;
+        let levels = (usize::BITS - (self.num_blocks - 1).leading_zeros()) as usize;
+
+        let mut indices: Vec<FheUint16> = (0..self.num_blocks)
+            .map(|i| FheUint16::encrypt_trivial(i as u16))
+            .collect();
+        let mut valid = is_free.to_vec();
+        // each block's remaining distance bits, highest first, so a level consumes the last one.
+        let mut distance: Vec<Vec<FheBool>> = free_rank
+            .par_iter()
+            .enumerate()
+            .map(|(i, rank)| {
+                context.install();
+                let places = -rank + (i + 1) as u16;
+                (0..levels)
+                    .rev()
+                    .map(|bit| (&places & (1u16 << bit)).ne(0u16))
+                    .collect()
+            })
+            .collect();
+
+        for level in 0..levels {
+            let stride = 1 << level;
+            let moves: Vec<FheBool> = valid
+                .par_iter()
+                .zip(distance.par_iter_mut())
+                .map(|(valid, bits)| {
+                    context.install();
+                    valid & bits.pop().expect("one distance bit per level")
+                })
+                .collect();
+            // a position takes the block arriving from `stride` places on, otherwise it keeps its own, vacated if that block moved.
+            let shifted: Vec<(FheUint16, FheBool, Vec<FheBool>)> = (0..self.num_blocks)
+                .into_par_iter()
+                .map(|p| {
+                    context.install();
+                    let stays = &valid[p] & !&moves[p];
+                    match moves.get(p + stride) {
+                        Some(incoming) => (
+                            incoming.if_then_else(&indices[p + stride], &indices[p]),
+                            incoming | stays,
+                            distance[p + stride]
+                                .iter()
+                                .zip(&distance[p])
+                                .map(|(arriving, own)| incoming.if_then_else(arriving, own))
+                                .collect(),
+                        ),
+                        None => (indices[p].clone(), stays, distance[p].clone()),
+                    }
+                })
+                .collect();
+            indices.clear();
+            valid.clear();
+            distance.clear();
+            for (index, flag, bits) in shifted {
+                indices.push(index);
+                valid.push(flag);
+                distance.push(bits);
+            }
         }
+        indices.truncate(slots);
+        indices
+            .into_par_iter()
+            .map(|index| {
+                context.install();
+                W::from_count(FheUint32::cast_from(index))
+                    .scalar_mul(self.block_size as u64)
+                    .scalar_add(self.base_offset)
+            })
+            .collect()
     }
 
-    /// frees a pointer by equality only; the entire slab scans once, compares each encrypted offset, and writes `enc_false` into matching bitmap cells with no early exit, so ciphertexts that never belonged to this tier simply leave the bitmap unchanged.
-    pub fn free(&mut self, ptr: &EncryptedPtr) {
-        set_server_key(self.server_key.clone());
+    /// frees a pointer in one fixed pass over the slab; matching cells get `enc_false` with no early exit, so ciphertexts that never belonged to this tier simply leave the bitmap unchanged.
+    /// `IndexDecode` applies whenever the block size is a power of two and every index fits in 16 bits; other layouts fall back to address equality.
+    pub fn free(&mut self, ptr: &EncryptedPtr<W>) {
+        let _guard = self.context.enter();
 
-        for i in 0..self.num_blocks {
-            let candidate = &self.base_offset + &self.enc_offsets_u64[i];
-            let is_match = candidate.eq(&ptr.0);
-            let current = self.bitmap[i].clone();
-            let updated = is_match.if_then_else(&self.enc_false, &current);
-            self.bitmap[i] = updated;
+        match self.decode_shift() {
+            Some(shift) if self.packed.is_some() => self.free_packed(ptr, shift),
+            Some(shift) if self.free_strategy == FreeStrategy::IndexDecode => {
+                self.free_by_index(ptr, shift)
+            }
+            _ => self.free_by_address(ptr),
+        }
+    }
+
+    /// releases a batch of pointers with a single write per cell: every pointer is decoded (or compared) once per block, the per-pointer match bits are ORed, and each cell is cleared once.
+    /// Duplicate and foreign pointers are harmless; the work depends only on the tier size and the batch length.
+    pub fn free_batch(&mut self, ptrs: &[EncryptedPtr<W>]) {
+        let _guard = self.context.enter();
+        if ptrs.is_empty() {
+            return;
+        }
+        let shift = self.decode_shift();
+        if shift.is_none()
+            || (self.packed.is_none() && self.free_strategy == FreeStrategy::AddressEquality)
+        {
+            self.prepare_addresses();
+        }
+        let context = &self.context;
+        let enc_false = &self.enc_false;
+
+        let release: Vec<FheBool> = match shift {
+            Some(shift) if self.packed.is_some() => {
+                let decoded: Vec<(FheUint64, FheBool)> = ptrs
+                    .par_iter()
+                    .map(|ptr| {
+                        context.install();
+                        let (block_index, valid) = self.decode_pointer(ptr, shift);
+                        (block_index.to_u64(), valid)
+                    })
+                    .collect();
+                if let Some(packed) = self.packed.as_mut() {
+                    packed.clear_indices(&decoded, context);
+                }
+                return;
+            }
+            Some(shift) if self.free_strategy == FreeStrategy::IndexDecode => {
+                let decoded: Vec<(FheUint16, FheBool)> = ptrs
+                    .par_iter()
+                    .map(|ptr| {
+                        context.install();
+                        let (block_index, valid) = self.decode_pointer(ptr, shift);
+                        (block_index.to_u16(), valid)
+                    })
+                    .collect();
+                (0..self.num_blocks)
+                    .into_par_iter()
+                    .map(|i| {
+                        context.install();
+                        let matches = decoded
+                            .iter()
+                            .map(|(index, valid)| index.eq(i as u16) & valid);
+                        or_all(matches, enc_false)
+                    })
+                    .collect()
+            }
+            _ => (0..self.num_blocks)
+                .into_par_iter()
+                .map(|i| {
+                    context.install();
+                    let address = self.block_address(i);
+                    or_all(ptrs.iter().map(|ptr| address.eq(&ptr.0)), enc_false)
+                })
+                .collect(),
+        };
+
+        self.clear_released(release);
+    }
+
+    /// clears every cell whose release bit is set and marks the groups holding one as free; untouched groups keep their summary.
+    fn clear_released(&mut self, release: Vec<FheBool>) {
+        let context = &self.context;
+        let enc_false = &self.enc_false;
+        let width = self.group_width();
+        if let Some(groups) = self.group_free.as_mut() {
+            groups
+                .par_iter_mut()
+                .zip(release.par_chunks(width))
+                .for_each(|(summary, released)| {
+                    context.install();
+                    *summary |= or_all(released.iter().cloned(), enc_false);
+                });
+        }
+        self.bitmap
+            .par_iter_mut()
+            .zip(release.into_par_iter())
+            .for_each(|(cell, released)| {
+                context.install();
+                *cell &= !released;
+            });
+    }
+
+    pub fn free_strategy(&self) -> FreeStrategy {
+        self.free_strategy
+    }
+
+    pub fn set_free_strategy(&mut self, strategy: FreeStrategy) {
+        self.free_strategy = strategy;
+    }
+
+    /// moves the bitmap, the lookup tables and the constants onto the device of the installed key, so GPU scans stop copying them in on every call.
+    #[cfg(feature = "gpu")]
+    pub fn move_to_current_device(&mut self) {
+        let _guard = self.context.enter();
+        let context = &self.context;
+        context.move_to_device(&mut self.bitmap, FheBool::move_to_current_device);
+        context.move_to_device(&mut self.enc_offsets_u64, W::move_to_current_device);
+        if let Some(addresses) = self.enc_addresses_u64.as_mut() {
+            context.move_to_device(addresses, W::move_to_current_device);
+        }
+        if let Some(packed) = self.packed.as_mut() {
+            packed.move_to_current_device(context);
+        }
+        if let Some(groups) = self.group_free.as_mut() {
+            context.move_to_device(groups, FheBool::move_to_current_device);
+        }
+        self.enc_false.move_to_current_device();
+        self.enc_true.move_to_current_device();
+        self.enc_zero_u32.move_to_current_device();
+        self.enc_zero_u64.move_to_current_device();
+    }
+
+    /// writes the occupancy bits in their current layout: one flag per block, or the packed words.
+    pub(crate) fn write_snapshot(&self, out: &mut SnapshotWriter<impl Write>) -> io::Result<()> {
+        match &self.packed {
+            Some(packed) => out.write_section(packed.words().iter().cloned()),
+            None => out.write_section(self.bitmap.iter().cloned()),
+        }
+    }
+
+    /// reads the occupancy bits `write_snapshot` stored under `layout` for a tier of `num_blocks` blocks of `block_size` bytes; runs before the tier is built, so a stream can only make the restore allocate as much as it actually holds.
+    pub(crate) fn read_snapshot(
+        input: &mut SnapshotReader<impl Read>,
+        block_size: usize,
+        num_blocks: usize,
+        layout: BitmapLayout,
+    ) -> io::Result<SnapshotBits> {
+        match layout {
+            BitmapLayout::Flags => Ok(SnapshotBits::Flags(input.read_section(num_blocks)?)),
+            BitmapLayout::Packed if decode_shift(block_size, num_blocks).is_some() => {
+                let words = input.read_section(num_blocks.div_ceil(FLAGS_PER_WORD))?;
+                Ok(SnapshotBits::Packed(words))
+            }
+            BitmapLayout::Packed => Err(invalid_data(
+                "snapshot packs a tier that cannot use the packed layout",
+            )),
+        }
+    }
+
+    /// replaces the occupancy bits with ones `read_snapshot` returned for this tier's layout.
+    pub(crate) fn restore_snapshot(&mut self, bits: SnapshotBits) {
+        match bits {
+            SnapshotBits::Flags(bitmap) => {
+                self.bitmap = bitmap;
+                self.packed = None;
+            }
+            SnapshotBits::Packed(words) => {
+                self.packed = Some(PackedBitmap::from_words(words, self.num_blocks));
+                self.bitmap = Vec::new();
+            }
+        }
+        self.sync_groups();
+    }
+
+    fn decode_shift(&self) -> Option<u32> {
+        decode_shift(self.block_size, self.num_blocks)
+    }
+
+    /// compares each encrypted block address against the pointer with a full-width equality.
+    fn free_by_address(&mut self, ptr: &EncryptedPtr<W>) {
+        self.prepare_addresses();
+
+        let release = (0..self.num_blocks)
+            .map(|i| self.block_address(i).eq(&ptr.0))
+            .collect();
+        self.clear_released(release);
+    }
+
+    /// decodes the pointer once into a 16-bit block index (subtract base, public shift, public range and alignment checks) and matches every cell against its plaintext index with a scalar equality.
+    /// Pointers below the base wrap to huge offsets and fail the range check, so foreign and null pointers match nothing.
+    /// A group summary is updated the same way, from the index shifted by the public group width, at one scalar equality per group.
+    fn free_by_index(&mut self, ptr: &EncryptedPtr<W>, shift: u32) {
+        let context = &self.context;
+        let (block_index, valid) = self.decode_pointer(ptr, shift);
+        let index = block_index.to_u16();
+
+        let width = self.group_width();
+        if let Some(groups) = self.group_free.as_mut() {
+            let group = block_index.scalar_shr(width.trailing_zeros()).to_u16();
+            groups.par_iter_mut().enumerate().for_each(|(g, summary)| {
+                context.install();
+                *summary |= group.eq(g as u16) & &valid;
+            });
         }
+
+        self.bitmap
+            .par_iter_mut()
+            .enumerate()
+            .for_each(|(i, cell)| {
+                context.install();
+                *cell &= !(index.eq(i as u16) & (&valid));
+            });
     }
+
+    /// the packed layout clears a single bit selected by the decoded index, one masked word update per 64 blocks.
+    fn free_packed(&mut self, ptr: &EncryptedPtr<W>, shift: u32) {
+        let (block_index, valid) = self.decode_pointer(ptr, shift);
+        if let Some(packed) = self.packed.as_mut() {
+            packed.clear_index(&block_index.to_u64(), &valid, &self.context);
+        }
+    }
+
+    /// encrypted flag that holds when `ptr` lies inside this tier's public address range.
+    pub fn contains(&self, ptr: &EncryptedPtr<W>) -> FheBool {
+        let _guard = self.context.enter();
+        let tier_span = self.block_size as u64 * self.num_blocks as u64;
+        ptr.0.scalar_sub(self.base_offset).scalar_lt(tier_span)
+    }
+
+    /// returns the pointer's block index within this tier plus an encrypted flag that holds only for in-range, block-aligned pointers.
+    fn decode_pointer(&self, ptr: &EncryptedPtr<W>, shift: u32) -> (W, FheBool) {
+        let block_size = self.block_size as u64;
+        let tier_span = block_size * self.num_blocks as u64;
+
+        let relative = ptr.0.scalar_sub(self.base_offset);
+        let in_range = relative.scalar_lt(tier_span);
+        let aligned = relative.scalar_bitand(block_size - 1).scalar_eq(0);
+        let valid = (&in_range) & (&aligned);
+        (relative.scalar_shr(shift), valid)
+    }
+}
+
+/// occupancy bits read from a snapshot, in the layout they were stored in.
+pub(crate) enum SnapshotBits {
+    Flags(Vec<FheBool>),
+    Packed(Vec<FheUint64>),
+}
+
+/// the index-decode shift for a tier: power-of-two block sizes whose every index fits in 16 bits.
+fn decode_shift(block_size: usize, num_blocks: usize) -> Option<u32> {
+    let fits_u16 = num_blocks <= usize::from(u16::MAX) + 1;
+    (block_size.is_power_of_two() && fits_u16).then(|| block_size.trailing_zeros())
+}
+
+fn or_all(bits: impl Iterator<Item = FheBool>, enc_false: &FheBool) -> FheBool {
+    bits.reduce(|acc, bit| acc | bit)
+        .unwrap_or_else(|| enc_false.clone())
 }
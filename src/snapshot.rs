@@ -0,0 +1,150 @@
+//! snapshot defines the versioned stream `CryptMalloc::snapshot` writes and `CryptMalloc::restore` reads: a plaintext header (magic, version, pointer width, tier layout and materialized block counts, arena bounds, growth policy) followed by typed sections.
+//! A section is a run of ciphertexts stored as tfhe compressed ciphertext lists of at most `SNAPSHOT_CHUNK` entries each, so a reader over a memory-mapped `&[u8]` only ever expands one chunk at a time.
+//! Section lengths follow from the header, so nothing but the header is plaintext and no per-section framing beyond tfhe's own safe serialization is needed.
+
+use crate::{keys::invalid_data, word::PtrWord};
+use std::io::{self, Read, Write};
+use tfhe::{
+    safe_serialization::{safe_deserialize, safe_serialize},
+    CompressedCiphertextList, CompressedCiphertextListBuilder, FheBool,
+};
+
+/// leading bytes of every snapshot stream.
+pub const SNAPSHOT_MAGIC: [u8; 8] = *b"CMALLOC\0";
+/// bumped whenever the header or the section order changes; `restore` rejects every other version.
+pub const SNAPSHOT_VERSION: u32 = 2;
+/// ciphertexts per compressed list.
+pub const SNAPSHOT_CHUNK: usize = 4096;
+/// byte limit for one serialized list; far above `SNAPSHOT_CHUNK` compressed ciphertexts, well below anything a corrupt length prefix could claim.
+pub const SNAPSHOT_LIST_LIMIT: u64 = 1 << 32;
+
+/// a ciphertext type that can travel in a snapshot section.
+pub(crate) trait Section: Sized {
+    fn push_into(self, builder: &mut CompressedCiphertextListBuilder);
+    fn get_from(list: &CompressedCiphertextList, index: usize) -> Option<Self>;
+}
+
+impl Section for FheBool {
+    fn push_into(self, builder: &mut CompressedCiphertextListBuilder) {
+        builder.push(self);
+    }
+
+    fn get_from(list: &CompressedCiphertextList, index: usize) -> Option<Self> {
+        list.get::<FheBool>(index).ok().flatten()
+    }
+}
+
+impl<W: PtrWord> Section for W {
+    fn push_into(self, builder: &mut CompressedCiphertextListBuilder) {
+        self.compress_into(builder);
+    }
+
+    fn get_from(list: &CompressedCiphertextList, index: usize) -> Option<Self> {
+        W::expand_from(list, index)
+    }
+}
+
+/// writes the header fields and sections in order; compression needs the server key installed on the calling thread.
+pub(crate) struct SnapshotWriter<T: Write> {
+    writer: T,
+}
+
+impl<T: Write> SnapshotWriter<T> {
+    pub(crate) fn new(mut writer: T, word_bits: u32) -> io::Result<Self> {
+        writer.write_all(&SNAPSHOT_MAGIC)?;
+        writer.write_all(&SNAPSHOT_VERSION.to_le_bytes())?;
+        writer.write_all(&word_bits.to_le_bytes())?;
+        Ok(Self { writer })
+    }
+
+    pub(crate) fn write_u64(&mut self, value: u64) -> io::Result<()> {
+        self.writer.write_all(&value.to_le_bytes())
+    }
+
+    pub(crate) fn write_section<S: Section>(
+        &mut self,
+        items: impl IntoIterator<Item = S>,
+    ) -> io::Result<()> {
+        let mut items = items.into_iter().peekable();
+        while items.peek().is_some() {
+            let mut builder = CompressedCiphertextListBuilder::new();
+            for item in items.by_ref().take(SNAPSHOT_CHUNK) {
+                item.push_into(&mut builder);
+            }
+            let list = builder.build().map_err(invalid_data)?;
+            safe_serialize(&list, &mut self.writer, SNAPSHOT_LIST_LIMIT).map_err(invalid_data)?;
+        }
+        Ok(())
+    }
+
+    pub(crate) fn finish(mut self) -> io::Result<()> {
+        self.writer.flush()
+    }
+}
+
+/// reads what `SnapshotWriter` wrote, in the same order; expansion needs the server key installed on the calling thread.
+pub(crate) struct SnapshotReader<T: Read> {
+    reader: T,
+}
+
+impl<T: Read> SnapshotReader<T> {
+    /// checks the magic, the version and that the stream was written with a `word_bits`-bit pointer word.
+    pub(crate) fn new(mut reader: T, word_bits: u32) -> io::Result<Self> {
+        let mut magic = [0u8; SNAPSHOT_MAGIC.len()];
+        reader.read_exact(&mut magic)?;
+        if magic != SNAPSHOT_MAGIC {
+            return Err(invalid_data("not a cryptmalloc snapshot"));
+        }
+        let mut snapshot = Self { reader };
+        let version = snapshot.read_u32()?;
+        if version != SNAPSHOT_VERSION {
+            return Err(invalid_data(format!(
+                "unsupported snapshot version {version}"
+            )));
+        }
+        let bits = snapshot.read_u32()?;
+        if bits != word_bits {
+            return Err(invalid_data(format!(
+                "snapshot uses {bits}-bit pointers, expected {word_bits}"
+            )));
+        }
+        Ok(snapshot)
+    }
+
+    fn read_u32(&mut self) -> io::Result<u32> {
+        let mut bytes = [0u8; 4];
+        self.reader.read_exact(&mut bytes)?;
+        Ok(u32::from_le_bytes(bytes))
+    }
+
+    pub(crate) fn read_u64(&mut self) -> io::Result<u64> {
+        let mut bytes = [0u8; 8];
+        self.reader.read_exact(&mut bytes)?;
+        Ok(u64::from_le_bytes(bytes))
+    }
+
+    /// header count that must also fit in memory as a `usize`.
+    pub(crate) fn read_len(&mut self) -> io::Result<usize> {
+        let value = self.read_u64()?;
+        usize::try_from(value).map_err(invalid_data)
+    }
+
+    pub(crate) fn read_section<S: Section>(&mut self, len: usize) -> io::Result<Vec<S>> {
+        let mut items = Vec::with_capacity(len.min(SNAPSHOT_CHUNK));
+        while items.len() < len {
+            let list: CompressedCiphertextList =
+                safe_deserialize(&mut self.reader, SNAPSHOT_LIST_LIMIT).map_err(invalid_data)?;
+            let expected = SNAPSHOT_CHUNK.min(len - items.len());
+            if list.len() != expected {
+                return Err(invalid_data("snapshot section has the wrong length"));
+            }
+            for index in 0..expected {
+                let item = S::get_from(&list, index).ok_or_else(|| {
+                    invalid_data("snapshot section holds the wrong ciphertext type")
+                })?;
+                items.push(item);
+            }
+        }
+        Ok(items)
+    }
+}
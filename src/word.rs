@@ -0,0 +1,174 @@
+//! PtrWord abstracts the radix width of pointers, block offsets and request sizes so small heaps can run on `FheUint16`/`FheUint32` instead of `FheUint64`; every comparison, add and mux costs in proportion to the width.
+//! Scalar operands are passed as `u64` and narrowed per width; comparisons against a constant the width cannot represent saturate instead of truncating, so out-of-range bounds stay correct.
+
+use crate::encrypted_option::CipherSelectable;
+use tfhe::{
+    prelude::*, ClientKey, CompressedCiphertextList, CompressedCiphertextListBuilder, FheBool,
+    FheUint16, FheUint32, FheUint64,
+};
+
+/// an unsigned encrypted integer wide enough to address the whole heap; implemented for `FheUint16`, `FheUint32` and `FheUint64`.
+pub trait PtrWord:
+    CipherSelectable + Send + Sync + for<'a> FheEq<&'a Self> + for<'a> FheOrd<&'a Self>
+{
+    const BITS: u32;
+
+    fn encrypt_word(value: u64, key: &ClientKey) -> Self;
+    /// noiseless encryption of a public value; needs the server key installed on the calling thread.
+    fn trivial_word(value: u64) -> Self;
+    fn decrypt_word(&self, key: &ClientKey) -> u64;
+
+    fn from_count(count: FheUint32) -> Self;
+    fn to_u16(&self) -> FheUint16;
+    fn to_u32(&self) -> FheUint32;
+    fn to_u64(&self) -> FheUint64;
+
+    fn add(&self, other: &Self) -> Self;
+    fn sub(&self, other: &Self) -> Self;
+    fn bitor(&self, other: &Self) -> Self;
+
+    fn scalar_add(&self, value: u64) -> Self;
+    fn scalar_sub(&self, value: u64) -> Self;
+    /// wrapping product with a public factor, which is narrowed to the word width first.
+    fn scalar_mul(&self, value: u64) -> Self;
+    fn scalar_bitand(&self, value: u64) -> Self;
+    fn scalar_shl(&self, shift: u32) -> Self;
+    fn scalar_shr(&self, shift: u32) -> Self;
+    fn scalar_eq(&self, value: u64) -> FheBool;
+    fn scalar_lt(&self, value: u64) -> FheBool;
+    fn scalar_le(&self, value: u64) -> FheBool;
+
+    /// appends the word to a compressed ciphertext list under construction.
+    fn compress_into(self, builder: &mut CompressedCiphertextListBuilder);
+    /// the word at `index` of a compressed list; `None` when the entry is missing or holds another type.
+    fn expand_from(list: &CompressedCiphertextList, index: usize) -> Option<Self>;
+
+    /// moves the ciphertext onto the device of the installed server key.
+    #[cfg(feature = "gpu")]
+    fn move_to_current_device(&mut self);
+}
+
+/// true when a `word_bits`-bit word can represent `value`.
+pub(crate) fn word_holds(value: u64, word_bits: u32) -> bool {
+    word_bits >= u64::BITS || value >> word_bits == 0
+}
+
+/// the narrowest supported word width, in bits, that can represent every address in `0..=heap_end`.
+pub fn narrowest_pointer_bits(heap_end: u64) -> u32 {
+    match heap_end {
+        0..=0xFFFF => 16,
+        0x1_0000..=0xFFFF_FFFF => 32,
+        _ => 64,
+    }
+}
+
+macro_rules! impl_ptr_word {
+    ($ty:ty, $clear:ty) => {
+        impl PtrWord for $ty {
+            const BITS: u32 = <$clear>::BITS;
+
+            fn encrypt_word(value: u64, key: &ClientKey) -> Self {
+                <$ty>::encrypt(value as $clear, key)
+            }
+
+            fn trivial_word(value: u64) -> Self {
+                <$ty>::encrypt_trivial(value as $clear)
+            }
+
+            fn decrypt_word(&self, key: &ClientKey) -> u64 {
+                let value: $clear = self.decrypt(key);
+                value as u64
+            }
+
+            fn from_count(count: FheUint32) -> Self {
+                <$ty>::cast_from(count)
+            }
+
+            fn to_u16(&self) -> FheUint16 {
+                FheUint16::cast_from(self.clone())
+            }
+
+            fn to_u32(&self) -> FheUint32 {
+                FheUint32::cast_from(self.clone())
+            }
+
+            fn to_u64(&self) -> FheUint64 {
+                FheUint64::cast_from(self.clone())
+            }
+
+            fn add(&self, other: &Self) -> Self {
+                self + other
+            }
+
+            fn sub(&self, other: &Self) -> Self {
+                self - other
+            }
+
+            fn bitor(&self, other: &Self) -> Self {
+                self | other
+            }
+
+            fn scalar_add(&self, value: u64) -> Self {
+                self + value as $clear
+            }
+
+            fn scalar_sub(&self, value: u64) -> Self {
+                self - value as $clear
+            }
+
+            fn scalar_mul(&self, value: u64) -> Self {
+                self * value as $clear
+            }
+
+            fn scalar_bitand(&self, value: u64) -> Self {
+                self & value as $clear
+            }
+
+            fn scalar_shl(&self, shift: u32) -> Self {
+                self << shift
+            }
+
+            fn scalar_shr(&self, shift: u32) -> Self {
+                self >> shift
+            }
+
+            fn scalar_eq(&self, value: u64) -> FheBool {
+                match <$clear>::try_from(value) {
+                    Ok(value) => self.eq(value),
+                    Err(_) => FheBool::encrypt_trivial(false),
+                }
+            }
+
+            fn scalar_lt(&self, value: u64) -> FheBool {
+                match <$clear>::try_from(value) {
+                    Ok(value) => self.lt(value),
+                    Err(_) => FheBool::encrypt_trivial(true),
+                }
+            }
+
+            fn scalar_le(&self, value: u64) -> FheBool {
+                match <$clear>::try_from(value) {
+                    Ok(value) => self.le(value),
+                    Err(_) => FheBool::encrypt_trivial(true),
+                }
+            }
+
+            fn compress_into(self, builder: &mut CompressedCiphertextListBuilder) {
+                builder.push(self);
+            }
+
+            fn expand_from(list: &CompressedCiphertextList, index: usize) -> Option<Self> {
+                list.get::<$ty>(index).ok().flatten()
+            }
+
+            #[cfg(feature = "gpu")]
+            fn move_to_current_device(&mut self) {
+                <$ty>::move_to_current_device(self)
+            }
+        }
+    };
+}
+
+impl_ptr_word!(FheUint16, u16);
+impl_ptr_word!(FheUint32, u32);
+impl_ptr_word!(FheUint64, u64);
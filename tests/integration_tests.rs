@@ -1,4 +1,38 @@
-use cryptmalloc::CryptMalloc;
+use cryptmalloc::{
+    narrowest_pointer_bits, AddressCache, AllocService, Arena, BatchPolicy, BitmapLayout,
+    CryptMalloc, EncryptedOption, EncryptedPtr, FreeStrategy, Heap, Keys, LayoutCost,
+    ObliviousMemory, ParameterProfile, PtrWord, RoutingMode, ScanMemory, SelectionMode,
+    ShardedCryptMalloc, SlabClass, TableConstruction, TierGrowth, ARENA_ALIGN, EVM, SIZE_CLASSES,
+    SNAPSHOT_VERSION,
+};
+use std::{
+    future::Future,
+    panic::{self, AssertUnwindSafe},
+    sync::Arc,
+    task::{Context, Poll, Wake, Waker},
+    time::Duration,
+};
+use tfhe::{prelude::*, FheUint16};
+
+fn small_slab(keys: &Keys, block_size: usize, num_blocks: usize, base: u64) -> SlabClass {
+    SlabClass::new(
+        block_size,
+        num_blocks,
+        base,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_true(),
+        keys.enc_zero_u32(),
+        keys.enc_zero_u64(),
+        keys.build_enc_offsets_u64(num_blocks, block_size),
+    )
+}
+
+fn decrypt_option(keys: &Keys, option: &EncryptedOption<EncryptedPtr>) -> Option<u64> {
+    let is_some: bool = option.is_some.decrypt(keys.client_key());
+    let value: u64 = option.value.0.decrypt(keys.client_key());
+    is_some.then_some(value)
+}
 
 #[test]
 fn allocator_smoke_test() {
@@ -14,3 +48,1424 @@ fn allocator_smoke_test() {
     let _small = allocator.allocate(small);
     allocator.arena().cursor();
 }
+
+#[test]
+fn prefix_selection_matches_linear_scan() {
+    let keys = Keys::new();
+    let mut linear = small_slab(&keys, 16, 5, 64);
+    let mut prefix = linear.clone();
+    prefix.set_selection_mode(SelectionMode::PrefixOr);
+
+    let mut expected = Vec::new();
+    for _ in 0..3 {
+        let a = decrypt_option(&keys, &linear.allocate_masked(&keys.enc_true()));
+        let b = decrypt_option(&keys, &prefix.allocate_masked(&keys.enc_true()));
+        assert_eq!(a, b);
+        expected.push(a);
+    }
+    assert_eq!(expected, vec![Some(64), Some(80), Some(96)]);
+
+    let hole = EncryptedPtr::new(keys.enc_u64(80));
+    linear.free(&hole);
+    prefix.free(&hole);
+    for want in [Some(80), Some(112), Some(128), None] {
+        assert_eq!(
+            decrypt_option(&keys, &linear.allocate_masked(&keys.enc_true())),
+            want
+        );
+        assert_eq!(
+            decrypt_option(&keys, &prefix.allocate_masked(&keys.enc_true())),
+            want
+        );
+    }
+    assert_eq!(
+        decrypt_option(&keys, &prefix.allocate_masked(&keys.enc_false())),
+        None
+    );
+}
+
+#[test]
+fn grouped_selection_matches_linear_scan() {
+    let keys = Keys::new();
+    let mut linear = small_slab(&keys, 16, 10, 0);
+    let mut grouped = linear.clone();
+    grouped.set_selection_mode(SelectionMode::Grouped);
+    assert_eq!(grouped.group_width(), 4);
+    assert_eq!(grouped.group_summary().map(<[_]>::len), Some(3));
+
+    for _ in 0..10 {
+        let a = decrypt_option(&keys, &linear.allocate_masked(&keys.enc_true()));
+        let b = decrypt_option(&keys, &grouped.allocate_masked(&keys.enc_true()));
+        assert_eq!(a, b);
+    }
+    assert_eq!(
+        decrypt_option(&keys, &grouped.allocate_masked(&keys.enc_true())),
+        None
+    );
+
+    let single = EncryptedPtr::new(keys.enc_u64(144));
+    let batch = [
+        EncryptedPtr::new(keys.enc_u64(96)),
+        EncryptedPtr::new(keys.enc_u64(16)),
+    ];
+    let mut by_address = grouped.clone();
+    by_address.set_free_strategy(FreeStrategy::AddressEquality);
+    for slab in [&mut linear, &mut grouped, &mut by_address] {
+        slab.free(&single);
+        slab.free(&EncryptedPtr::new(keys.enc_u64(24)));
+        if let Some(summary) = slab.group_summary() {
+            let summary: Vec<bool> = summary
+                .iter()
+                .map(|group| group.decrypt(keys.client_key()))
+                .collect();
+            assert_eq!(summary, [false, false, true]);
+        }
+        slab.free_batch(&batch);
+    }
+    for want in [Some(16), Some(96), Some(144), None] {
+        for slab in [&mut linear, &mut grouped, &mut by_address] {
+            assert_eq!(
+                decrypt_option(&keys, &slab.allocate_masked(&keys.enc_true())),
+                want
+            );
+        }
+    }
+}
+
+#[test]
+fn address_cache_switches_between_allocate_and_free() {
+    let keys = Keys::new();
+    let policies = [AddressCache::Recompute, AddressCache::Eager];
+    for allocate_policy in policies {
+        for free_policy in policies {
+            for strategy in [FreeStrategy::AddressEquality, FreeStrategy::IndexDecode] {
+                let mut slab = small_slab(&keys, 16, 4, 64);
+                slab.set_address_cache(allocate_policy);
+                for want in [64, 80, 96] {
+                    let served = slab.allocate_masked(&keys.enc_true());
+                    assert_eq!(decrypt_option(&keys, &served), Some(want));
+                }
+
+                slab.set_address_cache(free_policy);
+                slab.set_free_strategy(strategy);
+                assert_eq!(
+                    slab.enc_addresses_u64().is_some(),
+                    free_policy == AddressCache::Eager
+                );
+                slab.free(&EncryptedPtr::new(keys.enc_u64(80)));
+                slab.free_batch(&[
+                    EncryptedPtr::new(keys.enc_u64(64)),
+                    EncryptedPtr::new(keys.enc_u64(72)),
+                ]);
+                for want in [Some(64), Some(80), Some(112), None] {
+                    let served = slab.allocate_masked(&keys.enc_true());
+                    assert_eq!(
+                        decrypt_option(&keys, &served),
+                        want,
+                        "{allocate_policy:?} then {free_policy:?} with {strategy:?}"
+                    );
+                }
+            }
+        }
+    }
+
+    // the 16-byte tier frees by index decode, the 24-byte one by address equality.
+    let mut allocator = CryptMalloc::<2>::with_layout(
+        keys.clone(),
+        [(16, 2), (24, 2)],
+        0,
+        TableConstruction::Trivial,
+    );
+    allocator.set_address_cache(AddressCache::Eager);
+    let small = allocator.allocate(keys.enc_u64(16));
+    let large = allocator.allocate(keys.enc_u64(24));
+    assert_eq!(decrypt_option(&keys, &small), Some(0));
+    assert_eq!(decrypt_option(&keys, &large), Some(32));
+
+    allocator.set_address_cache(AddressCache::Recompute);
+    assert!(allocator
+        .slabs()
+        .iter()
+        .all(|slab| slab.enc_addresses_u64().is_none()));
+    allocator.free(&small.value);
+    allocator.free(&large.value);
+    allocator.set_address_cache(AddressCache::Eager);
+    assert!(allocator
+        .slabs()
+        .iter()
+        .all(|slab| slab.enc_addresses_u64().is_some()));
+    assert_eq!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(16))),
+        Some(0)
+    );
+    assert_eq!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(24))),
+        Some(32)
+    );
+}
+
+#[test]
+fn index_decode_free_ignores_foreign_pointers() {
+    let keys = Keys::new();
+    let mut slab = small_slab(&keys, 16, 4, 64);
+    for _ in 0..4 {
+        assert!(decrypt_option(&keys, &slab.allocate_masked(&keys.enc_true())).is_some());
+    }
+
+    for foreign in [0u64, 48, 72, 128, 1 << 40] {
+        slab.free(&EncryptedPtr::new(keys.enc_u64(foreign)));
+    }
+    assert_eq!(
+        decrypt_option(&keys, &slab.allocate_masked(&keys.enc_true())),
+        None
+    );
+
+    slab.free(&EncryptedPtr::new(keys.enc_u64(96)));
+    assert_eq!(
+        decrypt_option(&keys, &slab.allocate_masked(&keys.enc_true())),
+        Some(96)
+    );
+}
+
+#[test]
+fn packed_bitmap_matches_flag_layout() {
+    let keys = Keys::new();
+    let mut flags = small_slab(&keys, 32, 70, 256);
+    for _ in 0..66 {
+        flags.allocate_masked(&keys.enc_true());
+    }
+    let mut packed = flags.clone();
+    packed.set_bitmap_layout(BitmapLayout::Packed);
+    assert_eq!(packed.bitmap_layout(), BitmapLayout::Packed);
+
+    let free_count: u32 = packed.free_count().decrypt(keys.client_key());
+    assert_eq!(free_count, 4);
+
+    let hole = EncryptedPtr::new(keys.enc_u64(256 + 32 * 65));
+    flags.free(&hole);
+    packed.free(&hole);
+    packed.free(&EncryptedPtr::new(keys.enc_u64(256 + 32 * 70)));
+    for _ in 0..6 {
+        let a = decrypt_option(&keys, &flags.allocate_masked(&keys.enc_true()));
+        let b = decrypt_option(&keys, &packed.allocate_masked(&keys.enc_true()));
+        assert_eq!(a, b);
+    }
+
+    packed.set_bitmap_layout(BitmapLayout::Flags);
+    let round_trip: Vec<bool> = packed
+        .bitmap()
+        .iter()
+        .map(|flag| flag.decrypt(keys.client_key()))
+        .collect();
+    assert_eq!(round_trip, vec![true; 70]);
+}
+
+#[test]
+fn batch_allocation_matches_sequential_requests() {
+    let keys = Keys::new();
+    let mut batched = small_slab(&keys, 16, 4, 0);
+    let mut sequential = batched.clone();
+    for slab in [&mut batched, &mut sequential] {
+        slab.allocate_masked(&keys.enc_true());
+        slab.free(&EncryptedPtr::new(keys.enc_u64(0)));
+        slab.allocate_masked(&keys.enc_false());
+        slab.allocate_masked(&keys.enc_true());
+    }
+
+    let wanted = [true, false, true, true, true];
+    let masks: Vec<_> = wanted
+        .iter()
+        .map(|&want| {
+            if want {
+                keys.enc_true()
+            } else {
+                keys.enc_false()
+            }
+        })
+        .collect();
+    let batch: Vec<_> = batched
+        .allocate_batch(&masks)
+        .iter()
+        .map(|option| decrypt_option(&keys, option))
+        .collect();
+    let one_by_one: Vec<_> = masks
+        .iter()
+        .map(|mask| decrypt_option(&keys, &sequential.allocate_masked(mask)))
+        .collect();
+    assert_eq!(batch, one_by_one);
+    assert_eq!(batch, vec![Some(16), None, Some(32), Some(48), None]);
+
+    // a fragmented tier: the compaction has to carry blocks 1, 4, 5 and 8 over the allocated ones.
+    let mut fragmented = small_slab(&keys, 16, 11, 0);
+    for _ in 0..11 {
+        fragmented.allocate_masked(&keys.enc_true());
+    }
+    for block in [8u64, 1, 5, 4] {
+        fragmented.free(&EncryptedPtr::new(keys.enc_u64(16 * block)));
+    }
+    let mut one_by_one = fragmented.clone();
+    let masks: Vec<_> = [true, true, false, true, true, true]
+        .iter()
+        .map(|&want| {
+            if want {
+                keys.enc_true()
+            } else {
+                keys.enc_false()
+            }
+        })
+        .collect();
+    let batch: Vec<_> = fragmented
+        .allocate_batch(&masks)
+        .iter()
+        .map(|option| decrypt_option(&keys, option))
+        .collect();
+    let expected = [Some(16), Some(64), None, Some(80), Some(128), None];
+    assert_eq!(batch, expected);
+    let sequential: Vec<_> = masks
+        .iter()
+        .map(|mask| decrypt_option(&keys, &one_by_one.allocate_masked(mask)))
+        .collect();
+    assert_eq!(batch, sequential);
+
+    let mut unmaterialized = small_slab(&keys, 16, 0, 0);
+    let empty: Vec<_> = unmaterialized
+        .allocate_batch(&masks)
+        .iter()
+        .map(|option| decrypt_option(&keys, option))
+        .collect();
+    assert_eq!(empty, vec![None; masks.len()]);
+
+    let mut arena = Arena::new(
+        1000,
+        1100,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_zero_u64(),
+    );
+    // an oversized request fails on its own; the smaller ones after it still fit
+    let sizes: Vec<_> = [200u64, 40, 0, 50, 20, 5]
+        .iter()
+        .map(|&s| keys.enc_u64(s))
+        .collect();
+    let mut one_by_one = arena.clone();
+    let sequential: Vec<_> = sizes
+        .iter()
+        .map(|size| decrypt_option(&keys, &one_by_one.allocate(size.clone())))
+        .collect();
+    let bumped: Vec<_> = arena
+        .allocate_many(&sizes)
+        .iter()
+        .map(|option| decrypt_option(&keys, option))
+        .collect();
+    assert_eq!(
+        bumped,
+        vec![None, Some(1000), Some(1040), Some(1040), None, Some(1090)]
+    );
+    assert_eq!(bumped, sequential);
+    let cursor: u64 = arena.cursor().decrypt(keys.client_key());
+    assert_eq!(cursor, 1095);
+}
+
+#[test]
+fn batched_free_releases_every_pointer_once() {
+    let keys = Keys::new();
+    let mut flags = small_slab(&keys, 16, 6, 0);
+    for _ in 0..6 {
+        flags.allocate_masked(&keys.enc_true());
+    }
+    let mut by_address = flags.clone();
+    by_address.set_free_strategy(FreeStrategy::AddressEquality);
+    let mut packed = flags.clone();
+    packed.set_bitmap_layout(BitmapLayout::Packed);
+
+    let ptrs: Vec<_> = [16u64, 64, 16, 1 << 20, 40]
+        .iter()
+        .map(|&p| EncryptedPtr::new(keys.enc_u64(p)))
+        .collect();
+    for slab in [&mut flags, &mut by_address, &mut packed] {
+        slab.free_batch(&ptrs);
+        let reused: Vec<_> = (0..3)
+            .map(|_| decrypt_option(&keys, &slab.allocate_masked(&keys.enc_true())))
+            .collect();
+        assert_eq!(reused, vec![Some(16), Some(64), None]);
+    }
+}
+
+#[test]
+fn routing_uses_public_tier_bounds() {
+    let mut allocator = CryptMalloc::new(4096);
+    let arena_start = allocator.arena().start();
+    let cases = [
+        (0u64, Some(0u64)),
+        (1, Some(16)),
+        (16, Some(32)),
+        (17, Some(16384)),
+        (256, Some(4 * 16384)),
+        (257, Some(arena_start)),
+        (4096, None),
+    ];
+    for (size, expected) in cases {
+        let request = allocator.keys().enc_u64(size);
+        let result = allocator.allocate(request);
+        assert_eq!(
+            decrypt_option(allocator.keys(), &result),
+            expected,
+            "size {size}"
+        );
+    }
+}
+
+#[test]
+fn saved_keys_reload_into_a_working_allocator() {
+    let keys = Keys::new();
+    let mut bytes = Vec::new();
+    keys.save(&mut bytes).unwrap();
+    // save writes the compressed key the keys were generated with rather than deriving a new one.
+    let mut again = Vec::new();
+    keys.save(&mut again).unwrap();
+    assert_eq!(bytes, again);
+
+    let mut allocator = CryptMalloc::with_keys(Keys::load(bytes.as_slice()).unwrap(), 4096);
+    let request = keys.enc_u64(40);
+    let result = allocator.allocate(request);
+    assert_eq!(decrypt_option(&keys, &result), Some(16384 * 2));
+
+    assert!(Keys::load(&bytes[..bytes.len() / 2]).is_err());
+}
+
+#[test]
+fn racing_generators_settle_on_the_keys_on_disk() {
+    let path = std::env::temp_dir().join(format!("cryptmalloc-keys-{}.bin", std::process::id()));
+    let _ = std::fs::remove_file(&path);
+
+    let saved: Vec<Vec<u8>> = std::thread::scope(|scope| {
+        let starters: Vec<_> = (0..2)
+            .map(|_| scope.spawn(|| Keys::load_or_generate(&path).unwrap()))
+            .collect();
+        starters
+            .into_iter()
+            .map(|starter| {
+                let mut bytes = Vec::new();
+                starter.join().unwrap().save(&mut bytes).unwrap();
+                bytes
+            })
+            .collect()
+    });
+    let on_disk = std::fs::read(&path).unwrap();
+    std::fs::remove_file(&path).unwrap();
+    assert_eq!(saved[0], saved[1]);
+    assert_eq!(saved[0], on_disk);
+}
+
+#[test]
+fn trivial_tables_route_like_encrypted_ones() {
+    let keys = Keys::new();
+    let mut bytes = Vec::new();
+    keys.save(&mut bytes).unwrap();
+    let mut encrypted = CryptMalloc::with_keys(Keys::load(bytes.as_slice()).unwrap(), 4096);
+    let mut trivial = CryptMalloc::with_table_construction(
+        Keys::load(bytes.as_slice()).unwrap(),
+        4096,
+        TableConstruction::Trivial,
+    );
+
+    for size in [8u64, 16, 100, 200, 300] {
+        let lhs = encrypted.allocate(keys.enc_u64(size));
+        let rhs = trivial.allocate(keys.enc_u64(size));
+        assert_eq!(decrypt_option(&keys, &lhs), decrypt_option(&keys, &rhs));
+    }
+}
+
+#[test]
+fn custom_layout_routes_by_its_own_tiers() {
+    let keys = Keys::new();
+    let mut bytes = Vec::new();
+    keys.save(&mut bytes).unwrap();
+    let mut allocator = CryptMalloc::with_layout(
+        Keys::load(bytes.as_slice()).unwrap(),
+        [(32, 4), (128, 2)],
+        1024,
+        TableConstruction::Trivial,
+    );
+    assert_eq!(allocator.arena().start(), 32 * 4 + 128 * 2);
+
+    for (size, expected) in [(1u64, Some(0u64)), (33, Some(128)), (200, Some(384))] {
+        let result = allocator.allocate(keys.enc_u64(size));
+        assert_eq!(decrypt_option(&keys, &result), expected, "size {size}");
+    }
+
+    let cost = LayoutCost::of(&SIZE_CLASSES);
+    assert_eq!(cost.blocks_scanned, 1984);
+    assert_eq!(cost.routing_comparisons, 5);
+    assert_eq!(cost.slab_capacity, 5 * 16384);
+    assert_eq!(cost.worst_case_waste, 127);
+    assert_eq!(allocator.layout_cost().blocks_scanned, 6);
+}
+
+#[test]
+fn narrow_pointer_words_match_the_wide_allocator() {
+    let keys = Keys::new();
+    let mut bytes = Vec::new();
+    keys.save(&mut bytes).unwrap();
+    let tiers = [(16, 8), (64, 4)];
+    let mut wide: CryptMalloc<2> = CryptMalloc::with_layout(
+        Keys::load(bytes.as_slice()).unwrap(),
+        tiers,
+        512,
+        TableConstruction::Trivial,
+    );
+    let mut narrow: CryptMalloc<2, FheUint16> = CryptMalloc::with_layout(
+        Keys::load(bytes.as_slice()).unwrap(),
+        tiers,
+        512,
+        TableConstruction::Trivial,
+    );
+    assert_eq!(narrowest_pointer_bits(wide.arena().end()), 16);
+    assert_eq!(
+        narrowest_pointer_bits(SIZE_CLASSES.len() as u64 * 16384 + 4096),
+        32
+    );
+
+    let decrypt_narrow = |option: &EncryptedOption<EncryptedPtr<FheUint16>>| {
+        let is_some: bool = option.is_some.decrypt(keys.client_key());
+        is_some.then(|| option.value.0.decrypt_word(keys.client_key()))
+    };
+    let mut reused = Vec::new();
+    for size in [4u64, 20, 300, 64, 16] {
+        let wide_result = wide.allocate(keys.enc_u64(size));
+        let narrow_result = narrow.allocate(keys.enc_word(size));
+        assert_eq!(
+            decrypt_option(&keys, &wide_result),
+            decrypt_narrow(&narrow_result)
+        );
+        reused.push((wide_result.value, narrow_result.value));
+    }
+    for (wide_ptr, narrow_ptr) in &reused[..2] {
+        wide.free(wide_ptr);
+        narrow.free(narrow_ptr);
+    }
+    for size in [1u64, 60] {
+        let wide_result = wide.allocate(keys.enc_u64(size));
+        let narrow_result = narrow.allocate(keys.enc_word(size));
+        assert_eq!(
+            decrypt_option(&keys, &wide_result),
+            decrypt_narrow(&narrow_result)
+        );
+    }
+}
+
+#[test]
+fn heaps_past_the_pointer_word_are_rejected() {
+    let keys = Keys::new();
+    let rejects = |build: &dyn Fn()| panic::catch_unwind(AssertUnwindSafe(build)).is_err();
+    // the base alone leaves no room for the tiers in 16 bits, and the 64-bit heap end wraps.
+    assert!(rejects(&|| {
+        CryptMalloc::<1, FheUint16>::with_base(
+            keys.clone(),
+            [(16, 4)],
+            u64::from(u16::MAX) - 32,
+            0,
+            TableConstruction::Trivial,
+        );
+    }));
+    assert!(rejects(&|| {
+        CryptMalloc::<1>::with_base(
+            keys.clone(),
+            [(16, 4)],
+            u64::MAX - 32,
+            64,
+            TableConstruction::Trivial,
+        );
+    }));
+}
+
+#[test]
+fn freed_arena_chunks_are_reused() {
+    let keys = Keys::new();
+    let mut bytes = Vec::new();
+    keys.save(&mut bytes).unwrap();
+    let mut allocator = CryptMalloc::with_layout(
+        Keys::load(bytes.as_slice()).unwrap(),
+        [(32, 4)],
+        600,
+        TableConstruction::Trivial,
+    );
+
+    let first = allocator.allocate(keys.enc_u64(400));
+    assert_eq!(decrypt_option(&keys, &first), Some(128));
+    let full = allocator.allocate(keys.enc_u64(400));
+    assert_eq!(decrypt_option(&keys, &full), None);
+
+    allocator.free(&EncryptedPtr::new(keys.enc_u64(300)));
+    allocator.free(&first.value);
+    let reused = allocator.allocate(keys.enc_u64(350));
+    assert_eq!(decrypt_option(&keys, &reused), Some(128));
+    let bumped = allocator.allocate(keys.enc_u64(96));
+    assert_eq!(decrypt_option(&keys, &bumped), Some(528));
+
+    allocator.free_deferred(reused.value);
+    allocator.flush_frees();
+    let batch: Vec<_> = allocator
+        .allocate_many(&[keys.enc_u64(200), keys.enc_u64(100), keys.enc_u64(1)])
+        .iter()
+        .map(|option| decrypt_option(&keys, option))
+        .collect();
+    // the 100-byte request rounds up to 104 bytes and exactly fills the arena.
+    assert_eq!(batch, vec![Some(128), Some(624), Some(0)]);
+}
+
+#[test]
+fn parallel_routing_matches_sequential_routing() {
+    let keys = Keys::new();
+    // slab hits, a full tier, arena chunks, an arena overflow and a freed block served again.
+    let sizes = [8u64, 16, 16, 32, 32, 40, 50, 24, 0];
+    let run = |mode: RoutingMode| -> Vec<Option<u64>> {
+        let mut allocator = CryptMalloc::<2>::with_layout(
+            keys.clone(),
+            [(16, 2), (32, 1)],
+            64,
+            TableConstruction::Trivial,
+        );
+        allocator.set_routing_mode(mode);
+        let mut served: Vec<_> = sizes
+            .iter()
+            .map(|&size| decrypt_option(&keys, &allocator.allocate(keys.enc_u64(size))))
+            .collect();
+        allocator.free(&EncryptedPtr::new(keys.enc_u64(16)));
+        let refill = allocator.allocate(keys.enc_u64(4));
+        served.push(decrypt_option(&keys, &refill));
+        served
+    };
+
+    let sequential = run(RoutingMode::Sequential);
+    assert_eq!(
+        sequential,
+        vec![
+            Some(0),
+            Some(16),
+            None,
+            Some(32),
+            None,
+            Some(64),
+            None,
+            None,
+            None,
+            Some(16)
+        ]
+    );
+    assert_eq!(run(RoutingMode::Parallel), sequential);
+}
+
+#[test]
+fn evm_memory_reads_back_oblivious_stores() {
+    use cryptmalloc::Opcode::*;
+    let keys = Keys::new();
+    let _guard = keys.context().enter();
+    let program = vec![
+        Push1 as u8,
+        42,
+        Push1 as u8,
+        7,
+        Mstore as u8,
+        Push1 as u8,
+        9,
+        Push1 as u8,
+        12,
+        Mstore as u8,
+        Stop as u8,
+    ];
+    let mut evm = EVM::new(
+        program,
+        10,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_zero_u32(),
+        keys.enc_zero_u64(),
+    );
+    assert_eq!(evm.memory().len(), 10);
+    evm.run(7);
+    assert!(evm.halted().decrypt(keys.client_key()));
+
+    let load = |address: u32, condition| -> u64 {
+        evm.memory()
+            .read(&keys.enc_u32(address), &condition)
+            .decrypt(keys.client_key())
+    };
+    assert_eq!(load(7, keys.enc_true()), 42);
+    assert_eq!(load(7, keys.enc_false()), 0);
+    assert_eq!(load(3, keys.enc_true()), 0);
+    assert_eq!(load(12, keys.enc_true()), 0);
+}
+
+#[test]
+fn evm_stack_stays_within_its_fixed_buffer() {
+    use cryptmalloc::Opcode::*;
+    let keys = Keys::new();
+    let _guard = keys.context().enter();
+    let program = vec![
+        Push1 as u8,
+        11,
+        Push1 as u8,
+        22,
+        Push1 as u8,
+        33,
+        Swap1 as u8,
+        Pop as u8,
+        Push1 as u8,
+        0,
+        Mstore as u8,
+        Pop as u8,
+        Pop as u8,
+    ];
+    let mut evm = EVM::new(
+        program,
+        1,
+        keys.context().clone(),
+        keys.enc_false(),
+        keys.enc_zero_u32(),
+        keys.enc_zero_u64(),
+    );
+
+    evm.run(3);
+    assert_eq!(evm.stack_len().decrypt(keys.client_key()), 3u32);
+
+    // the swap leaves 22 on top for the pop, so the store writes 33; the final pop underflows and halts in place.
+    evm.run(6);
+    let stored: u64 = evm
+        .memory()
+        .read(&keys.enc_u32(0), &keys.enc_true())
+        .decrypt(keys.client_key());
+    assert_eq!(stored, 33);
+    assert!(evm.halted().decrypt(keys.client_key()));
+    assert_eq!(evm.pc().decrypt(keys.client_key()), 12u32);
+    assert_eq!(evm.stack_len().decrypt(keys.client_key()), 0u32);
+}
+
+#[test]
+fn evm_runs_a_program_to_its_stop() {
+    use cryptmalloc::Opcode::*;
+    let program = vec![
+        Push1 as u8,
+        6,
+        Push1 as u8,
+        7,
+        Mul as u8,
+        Push1 as u8,
+        3,
+        Mstore as u8,
+        Push1 as u8,
+        3,
+        Mload as u8,
+        Push1 as u8,
+        2,
+        Swap1 as u8,
+        Sub as u8,
+        Push1 as u8,
+        0,
+        Push1 as u8,
+        22,
+        Jumpi as u8,
+        Push1 as u8,
+        25,
+        Jump as u8,
+        0xfe,
+        0xfe,
+        Dup1 as u8,
+        Eq as u8,
+        Push1 as u8,
+        4,
+        Mstore as u8,
+        Stop as u8,
+    ];
+
+    let keys = Keys::new();
+    let _guard = keys.context().enter();
+    let new_evm = |program| {
+        EVM::new(
+            program,
+            8,
+            keys.context().clone(),
+            keys.enc_false(),
+            keys.enc_zero_u32(),
+            keys.enc_zero_u64(),
+        )
+    };
+
+    let mut evm = new_evm(program);
+    evm.run(26);
+    assert!(evm.halted().decrypt(keys.client_key()));
+    assert_eq!(evm.pc().decrypt(keys.client_key()), 30u32);
+    assert_eq!(evm.stack_len().decrypt(keys.client_key()), 0u32);
+    let cell = |address: u32| -> u64 {
+        evm.memory()
+            .read(&keys.enc_u32(address), &keys.enc_true())
+            .decrypt(keys.client_key())
+    };
+    assert_eq!(cell(3), 42);
+    assert_eq!(cell(4), 1);
+
+    let mut underflow = new_evm(vec![Add as u8, Push1 as u8, 1]);
+    underflow.run(3);
+    assert!(underflow.halted().decrypt(keys.client_key()));
+    assert_eq!(underflow.pc().decrypt(keys.client_key()), 0u32);
+    assert_eq!(underflow.stack_len().decrypt(keys.client_key()), 0u32);
+}
+
+#[test]
+fn evm_operands_past_32_bits_address_nothing() {
+    use cryptmalloc::Opcode::*;
+    let keys = Keys::new();
+    let _guard = keys.context().enter();
+    // PUSH1 only carries a byte, so the program builds 2^32 + low as 128 * 2, squared twice.
+    let wide = |low: u8| {
+        vec![
+            Push1 as u8,
+            128,
+            Push1 as u8,
+            2,
+            Mul as u8,
+            Dup1 as u8,
+            Mul as u8,
+            Dup1 as u8,
+            Mul as u8,
+            Push1 as u8,
+            low,
+            Add as u8,
+        ]
+    };
+    let new_evm = |program: Vec<u8>| {
+        let mut memory = ScanMemory::new(8, keys.enc_zero_u64(), keys.context().clone());
+        memory.write(&keys.enc_u32(0), &keys.enc_u64(7), &keys.enc_true());
+        memory.write(&keys.enc_u32(3), &keys.enc_u64(42), &keys.enc_true());
+        EVM::with_memory(
+            program,
+            memory,
+            keys.context().clone(),
+            keys.enc_false(),
+            keys.enc_zero_u32(),
+            keys.enc_zero_u64(),
+        )
+    };
+    let cell = |evm: &EVM, address: u32| -> u64 {
+        evm.memory()
+            .read(&keys.enc_u32(address), &keys.enc_true())
+            .decrypt(keys.client_key())
+    };
+
+    // the loaded word is stored to cell 0, which held 7.
+    let mut load = new_evm(
+        [
+            wide(3),
+            vec![Mload as u8, Push1 as u8, 0, Mstore as u8, Stop as u8],
+        ]
+        .concat(),
+    );
+    load.run(12);
+    assert_eq!(cell(&load, 0), 0);
+
+    let mut store = new_evm(
+        [
+            vec![Push1 as u8, 9],
+            wide(3),
+            vec![Mstore as u8, Stop as u8],
+        ]
+        .concat(),
+    );
+    store.run(11);
+    assert!(!store.halted().decrypt(keys.client_key()));
+    assert_eq!(cell(&store, 3), 42);
+
+    let mut jump = new_evm([wide(1), vec![Jump as u8, Stop as u8]].concat());
+    jump.run(10);
+    assert!(jump.halted().decrypt(keys.client_key()));
+    assert_eq!(jump.pc().decrypt(keys.client_key()), 12u32);
+    assert_eq!(jump.stack_len().decrypt(keys.client_key()), 1u32);
+}
+
+#[cfg(feature = "gpu")]
+#[test]
+fn gpu_allocator_matches_the_cpu_one() {
+    let keys = Keys::new_on_gpu();
+    assert!(keys.context().on_gpu());
+    let mut bytes = Vec::new();
+    keys.save(&mut bytes).unwrap();
+    let mut gpu = CryptMalloc::with_keys(Keys::load_on_gpu(bytes.as_slice()).unwrap(), 4096);
+    let mut cpu = CryptMalloc::with_keys(Keys::load(bytes.as_slice()).unwrap(), 4096);
+
+    for size in [8u64, 64, 300] {
+        let on_gpu = gpu.allocate(keys.enc_u64(size));
+        let on_cpu = cpu.allocate(keys.enc_u64(size));
+        assert_eq!(
+            decrypt_option(&keys, &on_gpu),
+            decrypt_option(&keys, &on_cpu)
+        );
+        gpu.free(&on_gpu.value);
+    }
+}
+
+#[test]
+fn restored_snapshot_continues_where_the_original_stopped() {
+    let keys = Keys::new();
+    let mut key_bytes = Vec::new();
+    keys.save(&mut key_bytes).unwrap();
+    let mut original = CryptMalloc::with_keys(Keys::load(key_bytes.as_slice()).unwrap(), 4096);
+    original.set_bitmap_layout(BitmapLayout::Packed);
+
+    let kept = original.allocate(keys.enc_u64(16));
+    let released = original.allocate(keys.enc_u64(16));
+    let large = original.allocate(keys.enc_u64(1000));
+    original.free(&large.value);
+    original.free_deferred(released.value.clone());
+
+    let mut snapshot = Vec::new();
+    original.snapshot(&mut snapshot).unwrap();
+    let mut restored: CryptMalloc = CryptMalloc::restore(
+        Keys::load(key_bytes.as_slice()).unwrap(),
+        snapshot.as_slice(),
+    )
+    .unwrap();
+    assert_eq!(restored.pending_frees(), 1);
+    restored.flush_frees();
+    original.flush_frees();
+
+    for size in [16u64, 16, 900] {
+        let lhs = original.allocate(keys.enc_u64(size));
+        let rhs = restored.allocate(keys.enc_u64(size));
+        assert_eq!(decrypt_option(&keys, &lhs), decrypt_option(&keys, &rhs));
+    }
+    assert_eq!(
+        decrypt_option(&keys, &restored.allocate(keys.enc_u64(16))),
+        Some(48)
+    );
+    assert_ne!(decrypt_option(&keys, &kept), Some(48));
+
+    assert!(CryptMalloc::<5, FheUint16>::restore(
+        Keys::load(key_bytes.as_slice()).unwrap(),
+        snapshot.as_slice()
+    )
+    .is_err());
+    let truncated = &snapshot[..snapshot.len() - 1];
+    assert!(
+        CryptMalloc::<5>::restore(Keys::load(key_bytes.as_slice()).unwrap(), truncated).is_err()
+    );
+}
+
+#[test]
+fn restore_rejects_malformed_headers_before_allocating() {
+    // (block_size, reserved, materialized) per tier, then the arena bounds; no sections follow.
+    let header = |word_bits: u32, tiers: &[(u64, u64, u64)], arena: (u64, u64)| {
+        let mut bytes = b"CMALLOC\0".to_vec();
+        bytes.extend(SNAPSHOT_VERSION.to_le_bytes());
+        bytes.extend(word_bits.to_le_bytes());
+        let mut fields = vec![tiers.len() as u64];
+        for &(block_size, reserved, materialized) in tiers {
+            fields.extend([block_size, reserved, materialized, 0]);
+        }
+        fields.extend([arena.0, arena.1, 0, 0, 0, 0]);
+        bytes.extend(fields.into_iter().flat_map(u64::to_le_bytes));
+        bytes
+    };
+    let keys = Keys::new();
+    let invalid = std::io::ErrorKind::InvalidData;
+
+    let product = header(64, &[(1 << 40, 1 << 40, 1)], (0, 0));
+    assert_eq!(
+        CryptMalloc::<1>::restore(keys.clone(), product.as_slice())
+            .unwrap_err()
+            .kind(),
+        invalid
+    );
+    let sum = header(64, &[(1 << 62, 2, 1), (1 << 63, 1, 1)], (0, 0));
+    assert_eq!(
+        CryptMalloc::<2>::restore(keys.clone(), sum.as_slice())
+            .unwrap_err()
+            .kind(),
+        invalid
+    );
+    let narrow = header(16, &[(16, 1 << 12, 1)], (1 << 16, 1 << 16));
+    assert_eq!(
+        CryptMalloc::<1, FheUint16>::restore(keys.clone(), narrow.as_slice())
+            .unwrap_err()
+            .kind(),
+        invalid
+    );
+
+    // a well-formed header claiming far more blocks than the stream carries fails on the missing bits.
+    let huge = 1u64 << 40;
+    let unbacked = header(64, &[(16, huge, huge)], (16 * huge, 16 * huge));
+    assert!(CryptMalloc::<1>::restore(keys, unbacked.as_slice()).is_err());
+}
+
+#[test]
+fn sharded_pool_serves_callers_from_disjoint_ranges() {
+    let pool = ShardedCryptMalloc::new(2, 1024);
+    let keys = pool.keys();
+    let span = pool.shard_span();
+
+    let first: Vec<(usize, Option<u64>)> = std::thread::scope(|scope| {
+        let workers: Vec<_> = (0..2u64)
+            .map(|caller| {
+                let handle = pool.handle(caller);
+                let request = keys.enc_u64(16);
+                scope.spawn(move || {
+                    let ptr = handle.allocate(request);
+                    (handle.shard(), decrypt_option(keys, &ptr))
+                })
+            })
+            .collect();
+        workers.into_iter().map(|w| w.join().unwrap()).collect()
+    });
+    for (shard, ptr) in first {
+        assert_eq!(ptr, Some(shard as u64 * span));
+        assert_eq!(pool.lock_shard(shard).heap_range(), pool.shard_range(shard));
+    }
+
+    let remote = pool.handle(1).allocate(keys.enc_u64(16));
+    assert_eq!(decrypt_option(keys, &remote), Some(span + 16));
+    pool.handle(0).free(&remote.value);
+    pool.free(&remote.value);
+    assert_eq!(
+        decrypt_option(keys, &pool.handle(3).allocate(keys.enc_u64(16))),
+        Some(span + 16)
+    );
+    assert_eq!(
+        decrypt_option(keys, &pool.handle(0).allocate(keys.enc_u64(16))),
+        Some(16)
+    );
+}
+
+#[test]
+fn sharded_pools_past_the_pointer_word_are_rejected() {
+    let keys = Keys::new();
+    let rejects = |build: &dyn Fn()| panic::catch_unwind(AssertUnwindSafe(build)).is_err();
+    // four 2^15-byte shards end at 2^17, and two shards of just over 2^63 bytes wrap 64 bits.
+    assert!(rejects(&|| {
+        ShardedCryptMalloc::<1, FheUint16>::with_layout(
+            keys.clone(),
+            4,
+            [(16, 1024)],
+            1 << 14,
+            TableConstruction::Trivial,
+        );
+    }));
+    assert!(rejects(&|| {
+        ShardedCryptMalloc::<1>::with_layout(
+            keys.clone(),
+            2,
+            [(16, 1)],
+            u64::MAX / 2,
+            TableConstruction::Trivial,
+        );
+    }));
+}
+
+#[test]
+fn sharded_pool_frees_while_rayon_workers_drive_more_shards_than_threads() {
+    use rayon::prelude::*;
+
+    let shards = rayon::current_num_threads() + 2;
+    let pool = ShardedCryptMalloc::<1>::with_layout(
+        Keys::new(),
+        shards,
+        [(16, 3)],
+        0,
+        TableConstruction::Trivial,
+    );
+    let keys = pool.keys();
+    let held: Vec<_> = (0..shards as u64)
+        .map(|caller| pool.handle(caller).allocate(keys.enc_u64(16)).value)
+        .collect();
+
+    let served: Vec<(usize, Option<u64>)> = std::thread::scope(|scope| {
+        scope.spawn(|| {
+            for ptr in &held {
+                pool.free(ptr);
+            }
+            pool.flush_frees();
+        });
+        (0..2 * shards)
+            .into_par_iter()
+            .map(|caller| {
+                let handle = pool.handle(caller as u64);
+                let ptr = handle.allocate(keys.enc_u64(16));
+                (handle.shard(), decrypt_option(keys, &ptr))
+            })
+            .collect()
+    });
+    for (shard, ptr) in served {
+        let ptr = ptr.expect("each shard has a block per caller");
+        assert!(pool.shard_range(shard).contains(&ptr));
+    }
+}
+
+fn block_on<F: Future>(future: F) -> F::Output {
+    struct Unpark(std::thread::Thread);
+    impl Wake for Unpark {
+        fn wake(self: Arc<Self>) {
+            self.0.unpark();
+        }
+    }
+    let waker = Waker::from(Arc::new(Unpark(std::thread::current())));
+    let mut cx = Context::from_waker(&waker);
+    let mut future = std::pin::pin!(future);
+    loop {
+        if let Poll::Ready(value) = future.as_mut().poll(&mut cx) {
+            return value;
+        }
+        std::thread::park();
+    }
+}
+
+#[test]
+fn service_batches_requests_and_resolves_each_future() {
+    let keys = Keys::new();
+    let allocator = CryptMalloc::with_keys(keys.clone(), 1024);
+    let policy = BatchPolicy {
+        max_batch: 4,
+        max_delay: Duration::from_millis(50),
+        threads: 2,
+    };
+    let service = AllocService::spawn(allocator, policy).unwrap();
+
+    let burst: Vec<_> = (0..3).map(|_| service.allocate(keys.enc_u64(16))).collect();
+    let served: Vec<_> = burst.into_iter().map(block_on).collect();
+    let addresses: Vec<_> = served
+        .iter()
+        .map(|ptr| decrypt_option(&keys, ptr))
+        .collect();
+    assert_eq!(addresses, vec![Some(0), Some(16), Some(32)]);
+
+    let freed = service.free(served[1].value.clone());
+    let reused = service.allocate(keys.enc_u64(16));
+    block_on(freed);
+    assert_eq!(decrypt_option(&keys, &block_on(reused)), Some(16));
+
+    let allocator = service.shutdown();
+    assert_eq!(allocator.pending_frees(), 0);
+}
+
+#[test]
+fn latency_profile_serves_and_snapshots() {
+    assert!(ParameterProfile::Latency.supports_snapshots());
+    assert!(!ParameterProfile::SmallKey.supports_snapshots());
+
+    let mut allocator = CryptMalloc::with_profile(ParameterProfile::Latency, 1024);
+    let keys = allocator.keys().clone();
+    let first = allocator.allocate(keys.enc_u64(16));
+    assert_eq!(decrypt_option(&keys, &first), Some(0));
+    allocator.free(&first.value);
+    assert_eq!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(16))),
+        Some(0)
+    );
+    allocator.snapshot(&mut Vec::new()).unwrap();
+}
+
+#[test]
+fn reallocate_releases_the_old_block_under_every_layout() {
+    let keys = Keys::new();
+    // the 24-byte tier cannot decode pointers, so its release goes through address matches.
+    let configs = [
+        (SelectionMode::Linear, BitmapLayout::Flags),
+        (SelectionMode::PrefixOr, BitmapLayout::Flags),
+        (SelectionMode::Grouped, BitmapLayout::Flags),
+        (SelectionMode::PrefixOr, BitmapLayout::Packed),
+    ];
+    for (mode, layout) in configs {
+        let mut allocator = CryptMalloc::<2>::with_layout(
+            keys.clone(),
+            [(16, 4), (24, 2)],
+            64,
+            TableConstruction::Trivial,
+        );
+        allocator.set_selection_mode(mode);
+        allocator.set_bitmap_layout(layout);
+
+        let small = allocator.allocate(keys.enc_u64(16));
+        let grown = allocator.reallocate(&small.value, keys.enc_u64(20));
+        assert_eq!(
+            decrypt_option(&keys, &grown),
+            Some(64),
+            "{mode:?} {layout:?}"
+        );
+        let refill = allocator.allocate(keys.enc_u64(16));
+        assert_eq!(
+            decrypt_option(&keys, &refill),
+            Some(0),
+            "{mode:?} {layout:?}"
+        );
+
+        let shrunk = allocator.reallocate(&grown.value, keys.enc_u64(8));
+        assert_eq!(
+            decrypt_option(&keys, &shrunk),
+            Some(16),
+            "{mode:?} {layout:?}"
+        );
+        let refill = allocator.allocate(keys.enc_u64(24));
+        assert_eq!(
+            decrypt_option(&keys, &refill),
+            Some(64),
+            "{mode:?} {layout:?}"
+        );
+
+        let chunk = allocator.allocate(keys.enc_u64(40));
+        assert_eq!(
+            decrypt_option(&keys, &chunk),
+            Some(112),
+            "{mode:?} {layout:?}"
+        );
+        let moved = allocator.reallocate(&chunk.value, keys.enc_u64(12));
+        assert_eq!(
+            decrypt_option(&keys, &moved),
+            Some(32),
+            "{mode:?} {layout:?}"
+        );
+        let reused = allocator.allocate(keys.enc_u64(40));
+        assert_eq!(
+            decrypt_option(&keys, &reused),
+            Some(112),
+            "{mode:?} {layout:?}"
+        );
+    }
+}
+
+#[test]
+fn reallocate_moves_misaligned_pointers_under_both_free_strategies() {
+    let keys = Keys::new();
+    // the 16-byte tier decodes its pointers by index, the 24-byte tier matches addresses.
+    let mut allocator = CryptMalloc::<2>::with_layout(
+        keys.clone(),
+        [(16, 4), (24, 2)],
+        64,
+        TableConstruction::Trivial,
+    );
+    let first = allocator.allocate(keys.enc_u64(16));
+    assert_eq!(decrypt_option(&keys, &first), Some(0));
+    let second = allocator.allocate(keys.enc_u64(24));
+    assert_eq!(decrypt_option(&keys, &second), Some(64));
+
+    for (misaligned, size, want) in [(3, 12, 16), (67, 20, 88)] {
+        let moved = allocator.reallocate(
+            &EncryptedPtr::new(keys.enc_u64(misaligned)),
+            keys.enc_u64(size),
+        );
+        assert_eq!(decrypt_option(&keys, &moved), Some(want), "{misaligned}");
+    }
+    // neither misaligned pointer released the block it falls inside.
+    assert_eq!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(16))),
+        Some(32)
+    );
+    assert_ne!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(24))),
+        Some(64)
+    );
+}
+
+#[test]
+fn reallocate_keeps_fitting_blocks_and_calloc_rejects_overflow() {
+    let mut allocator = CryptMalloc::new(1024);
+    let keys = allocator.keys().clone();
+    let first = allocator.allocate(keys.enc_u64(16));
+    assert_eq!(decrypt_option(&keys, &first), Some(0));
+
+    let shrunk = allocator.reallocate(&first.value, keys.enc_u64(12));
+    assert_eq!(decrypt_option(&keys, &shrunk), Some(0));
+    let grown = allocator.reallocate(&shrunk.value, keys.enc_u64(24));
+    assert_eq!(decrypt_option(&keys, &grown), Some(16 * 1024));
+    assert_eq!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(16))),
+        Some(0)
+    );
+
+    let too_big = allocator.reallocate(&grown.value, keys.enc_u64(1 << 20));
+    assert_eq!(decrypt_option(&keys, &too_big), None);
+    assert_eq!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(32))),
+        Some(16 * 1024 + 32)
+    );
+
+    let zeroed = allocator.calloc(keys.enc_u64(3), 8);
+    assert_eq!(decrypt_option(&keys, &zeroed), Some(16 * 1024 + 64));
+    // 2^40 * 2^24 wraps to zero, which would otherwise route to the smallest tier.
+    let overflow = allocator.calloc(keys.enc_u64(1 << 40), 1 << 24);
+    assert_eq!(decrypt_option(&keys, &overflow), None);
+    assert_eq!(
+        decrypt_option(&keys, &allocator.allocate(keys.enc_u64(16))),
+        Some(16)
+    );
+}
+
+#[test]
+fn heap_moves_words_between_allocated_blocks() {
+    let mut allocator = CryptMalloc::<2>::with_layout(
+        Keys::new(),
+        [(16, 4), (32, 2)],
+        64,
+        TableConstruction::Trivial,
+    );
+    let keys = allocator.keys().clone();
+    let mut heap = Heap::for_allocator(&allocator);
+    assert_eq!(heap.range(), 0..192);
+    let enc_true = keys.enc_true();
+    let at = |ptr: &EncryptedPtr, bytes: u64| EncryptedPtr::new(ptr.0.scalar_add(bytes));
+    let read =
+        |heap: &Heap, ptr: &EncryptedPtr| -> u64 { heap.load(ptr).decrypt(keys.client_key()) };
+
+    let small = allocator.allocate(keys.enc_u64(16)).value;
+    let large = allocator.allocate(keys.enc_u64(32)).value;
+    heap.store_many(
+        &[small.clone(), at(&small, 8)],
+        &[keys.enc_u64(7), keys.enc_u64(9)],
+        &enc_true,
+    );
+    let loaded: Vec<u64> = heap
+        .load_many(&[small.clone(), at(&small, 8)])
+        .iter()
+        .map(|word| word.decrypt(keys.client_key()))
+        .collect();
+    assert_eq!(loaded, [7, 9]);
+
+    heap.memcpy(&large, &small, 2, &enc_true);
+    assert_eq!((read(&heap, &large), read(&heap, &at(&large, 8))), (7, 9));
+    heap.memset(&at(&large, 8), &keys.enc_u64(5), 3, &enc_true);
+    assert_eq!(read(&heap, &large), 7);
+    assert_eq!(read(&heap, &at(&large, 24)), 5);
+    assert_eq!(read(&heap, &at(&small, 8)), 9);
+
+    // unaligned and out-of-range pointers read zero and write nothing.
+    heap.store(&at(&small, 3), &keys.enc_u64(1), &enc_true);
+    assert_eq!(read(&heap, &at(&small, 3)), 0);
+    assert_eq!(read(&heap, &small), 7);
+    assert_eq!(read(&heap, &EncryptedPtr::new(keys.enc_u64(192))), 0);
+
+    for offset in [16, 24, 32] {
+        heap.store(
+            &EncryptedPtr::new(keys.enc_u64(offset)),
+            &keys.enc_u64(1),
+            &enc_true,
+        );
+    }
+    let zeroed = allocator.calloc(keys.enc_u64(2), 8);
+    assert_eq!(decrypt_option(&keys, &zeroed), Some(16));
+    heap.zero(&zeroed.value, &keys.enc_u64(16), &zeroed.is_some);
+    let contents: Vec<u64> = [16, 24, 32]
+        .map(|offset| read(&heap, &EncryptedPtr::new(keys.enc_u64(offset))))
+        .to_vec();
+    assert_eq!(contents, [0, 0, 1]);
+}
+
+#[test]
+fn heap_reaches_consecutive_odd_sized_arena_chunks() {
+    let mut allocator = CryptMalloc::<2>::with_layout(
+        Keys::new(),
+        [(16, 4), (32, 2)],
+        128,
+        TableConstruction::Trivial,
+    );
+    let keys = allocator.keys().clone();
+    let mut heap = Heap::for_allocator(&allocator);
+    let enc_true = keys.enc_true();
+
+    // both sizes round up to ARENA_ALIGN, so the second chunk starts on a word.
+    let first = allocator.allocate(keys.enc_u64(33));
+    let second = allocator.allocate(keys.enc_u64(35));
+    assert_eq!(decrypt_option(&keys, &first), Some(128));
+    assert_eq!(
+        decrypt_option(&keys, &second),
+        Some(128 + 33u64.next_multiple_of(ARENA_ALIGN))
+    );
+
+    heap.store_many(
+        &[first.value.clone(), second.value.clone()],
+        &[keys.enc_u64(11), keys.enc_u64(13)],
+        &enc_true,
+    );
+    let loaded: Vec<u64> = heap
+        .load_many(&[first.value, second.value])
+        .iter()
+        .map(|word| word.decrypt(keys.client_key()))
+        .collect();
+    assert_eq!(loaded, [11, 13]);
+}
+
+#[test]
+fn chunked_tiers_grow_with_requests_and_match_eager_ones() {
+    let keys = Keys::new();
+    let tiers = [(16, 8), (32, 4)];
+    let mut eager =
+        CryptMalloc::<2>::with_layout(keys.clone(), tiers, 64, TableConstruction::Trivial);
+    let mut lazy = CryptMalloc::<2>::with_growth(
+        keys.clone(),
+        tiers,
+        64,
+        TableConstruction::Trivial,
+        TierGrowth::Chunked(3),
+    );
+    let materialized = |allocator: &CryptMalloc<2>| -> Vec<usize> {
+        allocator
+            .slabs()
+            .iter()
+            .map(SlabClass::num_blocks)
+            .collect()
+    };
+    assert_eq!(materialized(&lazy), [0, 0]);
+    assert_eq!(lazy.heap_range(), eager.heap_range());
+    lazy.set_bitmap_layout(BitmapLayout::Packed);
+
+    for size in [16, 16, 32, 16, 100, 16] {
+        let request = keys.enc_u64(size);
+        assert_eq!(
+            decrypt_option(&keys, &lazy.allocate(request.clone())),
+            decrypt_option(&keys, &eager.allocate(request)),
+            "size {size}"
+        );
+    }
+    // six requests round up to two chunks of three; the 32-byte tier caps at its four reserved blocks.
+    assert_eq!(lazy.requests_served(), 6);
+    assert_eq!(materialized(&lazy), [6, 4]);
+
+    let mut bytes = Vec::new();
+    lazy.snapshot(&mut bytes).unwrap();
+    let mut restored = CryptMalloc::<2>::restore(keys.clone(), bytes.as_slice()).unwrap();
+    assert_eq!(restored.tier_growth(), TierGrowth::Chunked(3));
+    assert_eq!(materialized(&restored), [6, 4]);
+    restored.set_bitmap_layout(BitmapLayout::Flags);
+    restored.set_selection_mode(SelectionMode::Grouped);
+    let request = keys.enc_u64(16);
+    assert_eq!(
+        decrypt_option(&keys, &restored.allocate(request.clone())),
+        decrypt_option(&keys, &eager.allocate(request))
+    );
+    assert_eq!(materialized(&restored), [8, 4]);
+
+    restored.set_tier_growth(TierGrowth::Eager);
+    assert_eq!(materialized(&restored), [8, 4]);
+}
+
+#[cfg(feature = "metrics")]
+#[test]
+fn metrics_sink_sees_every_phase_and_tier() {
+    use cryptmalloc::{metrics, HistogramSink, Phase};
+
+    let sink = Arc::new(HistogramSink::default());
+    metrics::set_sink(Some(sink.clone()));
+    let mut allocator = CryptMalloc::new(1024);
+    let ptr = allocator.allocate(allocator.keys().enc_u64(16));
+    allocator.free(&ptr.value);
+    metrics::set_sink(None);
+
+    let histograms = sink.snapshot();
+    for key in [
+        (Phase::Allocate, None),
+        (Phase::Route, None),
+        (Phase::Arena, None),
+        (Phase::Combine, None),
+        (Phase::Free, None),
+    ] {
+        assert!(histograms[&key].calls >= 1, "{key:?} was not recorded");
+    }
+    for tier in 0..SIZE_CLASSES.len() {
+        assert!(histograms[&(Phase::Slab, Some(tier))].calls >= 2);
+    }
+}